@@ -0,0 +1,119 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+typedef struct ArenaBlock {
+	struct ArenaBlock *next;
+	size_t size;
+	size_t used;
+	/* Keeps the data that follows aligned for any type */
+	union {
+		long double d;
+		void *p;
+		long long l;
+	} data[];
+} ArenaBlock;
+
+enum { ARENA_BLOCK_SIZE = 1 << 20, ARENA_ALIGN = 16 };
+
+static ArenaBlock *arena_block_new(size_t size)
+{
+	ArenaBlock *block;
+
+	block = malloc(sizeof(ArenaBlock) + size);
+	if (block == NULL)
+	{
+		printf("Out of memory allocating %zu bytes\n", size);
+		abort();
+	}
+	block->size = size;
+	block->used = 0;
+
+	return block;
+}
+
+/* The memory is not cleared, and is aligned to ARENA_ALIGN bytes */
+void *arena_alloc(Arena *arena, size_t size)
+{
+	ArenaBlock *block = arena->block;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	if (block == NULL || block->size - block->used < size)
+	{
+		/* Large requests get a block of their own, behind the current one,
+		 * so the rest of that can still be used */
+		if (block != NULL && size > ARENA_BLOCK_SIZE / 4)
+		{
+			ArenaBlock *large = arena_block_new(size);
+
+			large->next = block->next;
+			block->next = large;
+			block = large;
+		} else
+		{
+			block = arena_block_new(size > ARENA_BLOCK_SIZE ?
+					size : ARENA_BLOCK_SIZE);
+			block->next = arena->block;
+			arena->block = block;
+		}
+		arena->num_blocks++;
+	}
+
+	p = (char *) block->data + block->used;
+	block->used += size;
+	arena->size += size;
+
+	return p;
+}
+
+void *arena_calloc(Arena *arena, size_t n, size_t size)
+{
+	void *p;
+
+	assert(size == 0 || n <= (size_t) -1 / size);
+	p = arena_alloc(arena, n * size);
+	memset(p, 0, n * size);
+
+	return p;
+}
+
+/* Hand all of other's blocks over to arena, leaving other empty. Whatever
+ * is left in arena's current block keeps being used. */
+void arena_merge(Arena *arena, Arena *other)
+{
+	ArenaBlock *last;
+
+	if (other->block == NULL)
+		return;
+	if (arena->block == NULL)
+	{
+		*arena = *other;
+	} else
+	{
+		for (last = other->block; last->next; last = last->next)
+			;
+		last->next = arena->block->next;
+		arena->block->next = other->block;
+		arena->num_blocks += other->num_blocks;
+		arena->size += other->size;
+	}
+	memset(other, 0, sizeof(Arena));
+}
+
+void arena_free(Arena *arena)
+{
+	ArenaBlock *block = arena->block;
+
+	while (block)
+	{
+		ArenaBlock *next = block->next;
+
+		free(block);
+		block = next;
+	}
+	memset(arena, 0, sizeof(Arena));
+}
@@ -0,0 +1,21 @@
+#ifndef CG_ARENA_H
+#define CG_ARENA_H
+
+#include <stddef.h>
+
+/* A region allocator: objects are carved out of a few large blocks and are
+ * all freed at once with arena_free(). A zeroed Arena is empty and ready
+ * for use. An arena must only be used by one thread at a time; threads
+ * that build a shared structure each fill their own and merge them. */
+typedef struct Arena {
+	struct ArenaBlock *block; /* The one being filled comes first */
+	size_t num_blocks;
+	size_t size; /* Bytes handed out so far */
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_calloc(Arena *arena, size_t n, size_t size);
+void arena_merge(Arena *arena, Arena *other);
+void arena_free(Arena *arena);
+
+#endif
@@ -2,6 +2,31 @@
 #include <math.h>
 
 #include "bbox.h"
+#include "cgmath.h"
+
+BBox bbox_empty(void)
+{
+	BBox box;
+
+	box.xmin = box.ymin = box.zmin =  HUGE_VAL;
+	box.xmax = box.ymax = box.zmax = -HUGE_VAL;
+
+	return box;
+}
+
+BBox bbox_union(BBox a, BBox b)
+{
+	BBox c;
+
+	c.xmin = MIN(a.xmin, b.xmin);
+	c.ymin = MIN(a.ymin, b.ymin);
+	c.zmin = MIN(a.zmin, b.zmin);
+	c.xmax = MAX(a.xmax, b.xmax);
+	c.ymax = MAX(a.ymax, b.ymax);
+	c.zmax = MAX(a.zmax, b.zmax);
+
+	return c;
+}
 
 BBox bbox_transform(Mat4 m, BBox box)
 {
@@ -68,6 +93,10 @@ void bbox_split(BBox a, enum AXIS axis, float location, BBox *b, BBox *c)
 
 double bbox_surface_area(BBox a)
 {
-	return 2 * fabs(a.zmax - a.zmin) * fabs(a.ymax - a.ymin) * fabs(a.xmax - a.xmin);
+	double dx = fabs(a.xmax - a.xmin);
+	double dy = fabs(a.ymax - a.ymin);
+	double dz = fabs(a.zmax - a.zmin);
+
+	return 2 * (dx*dy + dy*dz + dz*dx);
 }
 
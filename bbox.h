@@ -10,6 +10,8 @@ typedef struct BBox {
 	float xmax, ymax, zmax;
 } BBox;
 
+BBox bbox_empty(void);
+BBox bbox_union(BBox a, BBox b);
 BBox bbox_transform(Mat4 m, BBox box);
 void bbox_split(BBox a, enum AXIS axis, float location, BBox *b, BBox *c);
 double bbox_surface_area(BBox a);
@@ -0,0 +1,300 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "bvh.h"
+#include "scene.h"
+
+enum { BVH_BINS = 16, BVH_LEAF_SIZE = 2 };
+
+typedef struct BvhBuilder {
+	Bvh *bvh;
+	Vec3 *centroid;
+} BvhBuilder;
+
+typedef struct BvhSplit {
+	enum AXIS axis;
+	int bin; /* Surfaces in bins below this one go left */
+	double min, scale; /* Maps a centroid coordinate to its bin */
+} BvhSplit;
+
+/* Half the surface area, which is all the SAH needs */
+static double bbox_half_area(BBox a)
+{
+	double dx = a.xmax - a.xmin, dy = a.ymax - a.ymin, dz = a.zmax - a.zmin;
+
+	if (dx < 0 || dy < 0 || dz < 0)
+		return 0;
+
+	return dx*dy + dy*dz + dz*dx;
+}
+
+static double vec3_axis(Vec3 v, enum AXIS axis)
+{
+	return axis == X_AXIS ? v.x : (axis == Y_AXIS ? v.y : v.z);
+}
+
+static int bin_index(double min, double scale, double x)
+{
+	int k = (x - min) * scale;
+
+	return CLAMP(k, 0, BVH_BINS - 1);
+}
+
+static void swap_surfaces(BvhBuilder *b, int i, int j)
+{
+	struct Surface *s;
+	Vec3 c;
+
+	s = b->bvh->surface[i];
+	b->bvh->surface[i] = b->bvh->surface[j];
+	b->bvh->surface[j] = s;
+
+	c = b->centroid[i];
+	b->centroid[i] = b->centroid[j];
+	b->centroid[j] = c;
+}
+
+/* Find the best split of [first, last) with binned SAH. Returns false if
+ * the node is better off as a leaf. */
+static bool find_split(BvhBuilder *b, int first, int last, BBox box,
+		BvhSplit *split)
+{
+	const int n = last - first;
+	double best_cost = n * bbox_half_area(box);
+	double cmin[3], cmax[3];
+	bool found = false;
+
+	cmin[0] = cmin[1] = cmin[2] =  HUGE_VAL;
+	cmax[0] = cmax[1] = cmax[2] = -HUGE_VAL;
+	for (int i = first; i < last; i++)
+		for (int a = 0; a < 3; a++)
+		{
+			cmin[a] = MIN(cmin[a], vec3_axis(b->centroid[i], a));
+			cmax[a] = MAX(cmax[a], vec3_axis(b->centroid[i], a));
+		}
+
+	for (int a = 0; a < 3; a++)
+	{
+		BBox bin_box[BVH_BINS], left_box, right_box;
+		int bin_count[BVH_BINS], left_count[BVH_BINS];
+		double left_area[BVH_BINS], scale;
+		int right_count;
+
+		if (cmax[a] - cmin[a] <= 0)
+			continue;
+		scale = BVH_BINS / (cmax[a] - cmin[a]);
+
+		for (int k = 0; k < BVH_BINS; k++)
+		{
+			bin_box[k] = bbox_empty();
+			bin_count[k] = 0;
+		}
+		for (int i = first; i < last; i++)
+		{
+			int k = bin_index(cmin[a], scale, vec3_axis(b->centroid[i], a));
+			bin_count[k]++;
+			bin_box[k] = bbox_union(bin_box[k], b->bvh->surface[i]->bbox);
+		}
+
+		/* Sweep from the left to get the cost of each left half... */
+		left_box = bbox_empty();
+		for (int k = 0; k < BVH_BINS - 1; k++)
+		{
+			left_box = bbox_union(left_box, bin_box[k]);
+			left_count[k] = (k > 0 ? left_count[k - 1] : 0) + bin_count[k];
+			left_area[k] = bbox_half_area(left_box);
+		}
+		/* ...and from the right to complete them */
+		right_box = bbox_empty();
+		right_count = 0;
+		for (int k = BVH_BINS - 1; k > 0; k--)
+		{
+			double cost;
+
+			right_box = bbox_union(right_box, bin_box[k]);
+			right_count += bin_count[k];
+			if (left_count[k - 1] == 0 || right_count == 0)
+				continue;
+
+			cost = left_count[k - 1] * left_area[k - 1] +
+					right_count * bbox_half_area(right_box);
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				split->axis = a;
+				split->bin = k;
+				split->min = cmin[a];
+				split->scale = scale;
+				found = true;
+			}
+		}
+	}
+
+	return found;
+}
+
+static int build_node(BvhBuilder *b, int first, int last, int depth)
+{
+	Bvh *bvh = b->bvh;
+	BBox box = bbox_empty();
+	BvhSplit split;
+	int index, mid;
+
+	for (int i = first; i < last; i++)
+		box = bbox_union(box, bvh->surface[i]->bbox);
+
+	index = bvh->num_nodes++;
+	bvh->node[index].bbox = box;
+	bvh->depth = MAX(bvh->depth, depth);
+
+	if (last - first <= BVH_LEAF_SIZE ||
+			!find_split(b, first, last, box, &split))
+	{
+		bvh->node[index].num_surfaces = last - first;
+		bvh->node[index].offset = first;
+		return index;
+	}
+
+	/* Partition the surfaces around the split plane */
+	mid = first;
+	for (int i = first; i < last; i++)
+		if (bin_index(split.min, split.scale,
+				vec3_axis(b->centroid[i], split.axis)) < split.bin)
+			swap_surfaces(b, i, mid++);
+	assert(mid > first && mid < last);
+
+	bvh->node[index].num_surfaces = 0;
+	build_node(b, first, mid, depth + 1);
+	bvh->node[index].offset = build_node(b, mid, last, depth + 1);
+
+	return index;
+}
+
+/* The upper 3x3 of world_to_model is a positive multiple of the identity.
+ * A mirroring one would flip the normals, which the shortcut leaves alone. */
+static bool is_scale_translate(const Mat4 m)
+{
+	if (!(m[0] > 0))
+		return false;
+	for (int j = 0; j < 3; j++)
+		for (int i = 0; i < 3; i++)
+			if (i == j ? m[4*j + i] != m[0] : m[4*j + i] != 0)
+				return false;
+
+	return true;
+}
+
+static void compile_surface(Surface *surf, SurfaceRecord *rec)
+{
+	const Shape *shape = surf->shape;
+	const Real *m = surf->world_to_model;
+
+	/* Mat4 is column major */
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 4; j++)
+			rec->to_model[i][j] = m[4*j + i];
+		for (int j = 0; j < 3; j++)
+			rec->normal_to_world[i][j] = m[4*i + j];
+	}
+	rec->scale_translate = is_scale_translate(m);
+	rec->type = shape->type;
+	rec->bbox = surf->bbox;
+	rec->surface = surf;
+
+	switch (shape->type)
+	{
+	case SHAPE_PLANE:
+	{
+		Vec3 a = shape->u.plane.edge1, b = shape->u.plane.edge2;
+		Vec3 n = vec3_cross(a, b);
+		Vec3 axn = vec3_cross(a, n), bxn = vec3_cross(b, n);
+		Real det = vec3_dot(a, bxn);
+
+		rec->u.plane.normal[0] = n.x;
+		rec->u.plane.normal[1] = n.y;
+		rec->u.plane.normal[2] = n.z;
+		rec->u.plane.alpha[0] = bxn.x/det;
+		rec->u.plane.alpha[1] = bxn.y/det;
+		rec->u.plane.alpha[2] = bxn.z/det;
+		rec->u.plane.beta[0] = -axn.x/det;
+		rec->u.plane.beta[1] = -axn.y/det;
+		rec->u.plane.beta[2] = -axn.z/det;
+		break;
+	}
+	case SHAPE_DISK:
+		rec->u.disk.radius2 = SQUARE(shape->u.disk.radius);
+		break;
+	case SHAPE_SPHERE:
+		rec->u.sphere.radius2 = SQUARE(shape->u.sphere.radius);
+		break;
+	case SHAPE_CYLINDER:
+		rec->u.cylinder.radius2 = SQUARE(shape->u.cylinder.radius);
+		rec->u.cylinder.height = shape->u.cylinder.height;
+		rec->u.cylinder.capped = shape->u.cylinder.capped;
+		break;
+	case SHAPE_CONE:
+	{
+		const float R = shape->u.cone.radius, h = shape->u.cone.height;
+		const float slant = sqrtf(h*h + R*R);
+
+		rec->u.cone.height = h;
+		rec->u.cone.k2 = SQUARE(R/h);
+		rec->u.cone.cos = h/slant;
+		rec->u.cone.sin = R/slant;
+		break;
+	}
+	case SHAPE_MESH:
+		rec->u.mesh = shape->u.mesh;
+		break;
+	}
+}
+
+Bvh *bvh_build(struct Surface *list)
+{
+	BvhBuilder b;
+	Bvh *bvh;
+	int n = 0;
+
+	for (Surface *surf = list; surf; surf = surf->next)
+		n++;
+
+	bvh = malloc(sizeof(Bvh));
+	bvh->num_surfaces = n;
+	bvh->surface = calloc(n, sizeof(Surface *));
+	/* A binary tree with at least one surface per leaf */
+	bvh->node = calloc(MAX(2*n - 1, 1), sizeof(BvhNode));
+	bvh->num_nodes = 0;
+	bvh->depth = 0;
+
+	b.bvh = bvh;
+	b.centroid = calloc(n, sizeof(Vec3));
+	n = 0;
+	for (Surface *surf = list; surf; surf = surf->next, n++)
+	{
+		bvh->surface[n] = surf;
+		b.centroid[n].x = (surf->bbox.xmin + surf->bbox.xmax)/2;
+		b.centroid[n].y = (surf->bbox.ymin + surf->bbox.ymax)/2;
+		b.centroid[n].z = (surf->bbox.zmin + surf->bbox.zmax)/2;
+	}
+
+	if (n > 0)
+		build_node(&b, 0, n, 0);
+	free(b.centroid);
+
+	/* The leaves are walked in this order, so the records are too */
+	bvh->record = calloc(MAX(n, 1), sizeof(SurfaceRecord));
+	for (int i = 0; i < n; i++)
+		compile_surface(bvh->surface[i], &bvh->record[i]);
+
+	return bvh;
+}
+
+void bvh_destroy(Bvh *bvh)
+{
+	free(bvh->node);
+	free(bvh->surface);
+	free(bvh->record);
+	free(bvh);
+}
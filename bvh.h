@@ -0,0 +1,65 @@
+#ifndef CG_BVH_H
+#define CG_BVH_H
+
+#include <stdbool.h>
+#include "bbox.h"
+
+struct Surface;
+struct Mesh;
+
+/* A surface compiled down to what the raytracer needs to intersect it. The
+ * transform from world to model space is an affine 3x4 matrix. Surfaces that
+ * are only translated and uniformly scaled are flagged, so rays can skip the
+ * full matrix product. */
+typedef struct SurfaceRecord {
+	float to_model[3][4];
+	float normal_to_world[3][3]; /* The inverse transpose of model to world */
+	bool scale_translate;
+	int type; /* Of the shape */
+	union {
+		struct {
+			/* In full precision, so that planes sharing an edge agree on
+			 * which side of it a ray lands */
+			Real normal[3];
+			Real alpha[3], beta[3]; /* Give the coordinates in the plane */
+		} plane;
+		struct {
+			float radius2;
+		} disk, sphere;
+		struct {
+			float radius2, height;
+			bool capped;
+		} cylinder;
+		struct {
+			float height;
+			float k2; /* Of the slope k = radius/height */
+			float cos, sin; /* Of the angle between the side and the axis */
+		} cone;
+		const struct Mesh *mesh;
+	} u;
+	BBox bbox;
+	struct Surface *surface;
+} SurfaceRecord;
+
+/* Interior nodes keep their left child right after themselves, so they only
+ * need to store the index of the right one. */
+typedef struct BvhNode {
+	BBox bbox;
+	int num_surfaces; /* Zero for interior nodes */
+	int offset; /* First surface for leaves, right child for interior nodes */
+} BvhNode;
+
+/* A bounding volume hierarchy over the world space boxes of all surfaces */
+typedef struct Bvh {
+	int num_nodes;
+	int depth; /* Of the deepest leaf, the root being at depth 0 */
+	BvhNode *node;
+	int num_surfaces;
+	struct Surface **surface;
+	SurfaceRecord *record; /* Of the surfaces, in the same order */
+} Bvh;
+
+Bvh *bvh_build(struct Surface *list);
+void bvh_destroy(Bvh *bvh);
+
+#endif
@@ -18,33 +18,34 @@ static void mat4_from_mat3(Mat4 a, Mat3 b)
 #undef A
 }
 
-MatrixStack *matstack_new(void)
+MatrixStack *matstack_new(Arena *arena)
 {
-	MatrixStack *stack = malloc(sizeof(MatrixStack));
-	stack->top = NULL;
+	MatrixStack *stack = arena_alloc(arena, sizeof(MatrixStack));
+	stack->top = stack->spare = NULL;
+	stack->arena = arena;
 	return stack;
 }
 
-void matstack_destroy(MatrixStack *stack)
-{
-	while (stack->top)
-		matstack_pop(stack);
-}
-
 void matstack_pop(MatrixStack *stack)
 {
 	Matrix *m;
 
 	m = stack->top;
 	stack->top = stack->top->next;
-	free(m);
+	m->next = stack->spare;
+	stack->spare = m;
 }
 
 void matstack_push(MatrixStack *stack)
 {
 	Matrix *new;
 
-	new = malloc(sizeof(Matrix));
+	if (stack->spare)
+	{
+		new = stack->spare;
+		stack->spare = new->next;
+	} else
+		new = arena_alloc(stack->arena, sizeof(Matrix));
 	new->next = stack->top;
 	stack->top = new;
 	if (new->next == NULL)
@@ -60,7 +61,7 @@ void matstack_push(MatrixStack *stack)
 
 Vec4 mat4_transform(const Mat4 m, Vec4 v)
 {
-	const double v0 = v.x, v1 = v.y, v2 = v.z, v3 = v.w;
+	const Real v0 = v.x, v1 = v.y, v2 = v.z, v3 = v.w;
 	Vec4 out;
 
 #define M(i,j) m[4*j+i]
@@ -82,7 +83,7 @@ Vec3 mat4_transform3_homo(const Mat4 m, Vec3 v)
 
 Vec3 mat4_transform3_hetero(const Mat4 m, Vec3 v)
 {
-	const double v0 = v.x, v1 = v.y, v2 = v.z;
+	const Real v0 = v.x, v1 = v.y, v2 = v.z;
 	Vec3 out;
 
 #define M(i,j) m[4*j+i]
@@ -111,7 +112,7 @@ void mat4_copy(Mat4 dst, const Mat4 src)
 void mat4_transpose(Mat4 m)
 {
 #define M(i,j) m[4*j + i]
-#define SWAP(i,j) do {double d;d = M(i,j);M(i,j) = M(j,i);M(j,i) = d;} while(0)
+#define SWAP(i,j) do {Real d;d = M(i,j);M(i,j) = M(j,i);M(j,i) = d;} while(0)
 	SWAP(0,1); SWAP(0,2); SWAP(0,3);
 	           SWAP(1,2); SWAP(1,3);
 	                      SWAP(2,3);
@@ -125,7 +126,7 @@ void mat4_mult(Mat4 c, const Mat4 a, const Mat4 b)
 #define C(i,j) c[4*j + i]
 	for (int i = 0; i < 4; i++)
 	{
-		double A0 = A(i, 0), A1 = A(i, 1), A2 = A(i, 2), A3 = A(i, 3);
+		Real A0 = A(i, 0), A1 = A(i, 1), A2 = A(i, 2), A3 = A(i, 3);
 		for (int j = 0; j < 4; j++)
 			C(i,j) = A0*B(0,j) + A1*B(1,j) + A2*B(2,j) + A3*B(3,j);
 	}
@@ -141,7 +142,7 @@ void mat4_lmul(const Mat4 b, Mat4 a)
 #define B(i,j) b[4*j + i]
 	for (int j = 0; j < 4; j++)
 	{
-		double A0 = A(0, j), A1 = A(1, j), A2 = A(2, j), A3 = A(3, j);
+		Real A0 = A(0, j), A1 = A(1, j), A2 = A(2, j), A3 = A(3, j);
 		for (int i = 0; i < 4; i++)
 			A(i,j) = B(i,0)*A0 + B(i,1)*A1 + B(i,2)*A2 + B(i,3)*A3;
 	}
@@ -156,7 +157,7 @@ void mat4_rmul(Mat4 a, const Mat4 b)
 #define B(i,j) b[4*j + i]
 	for (int i = 0; i < 4; i++)
 	{
-		double A0 = A(i, 0), A1 = A(i, 1), A2 = A(i, 2), A3 = A(i, 3);
+		Real A0 = A(i, 0), A1 = A(i, 1), A2 = A(i, 2), A3 = A(i, 3);
 		for (int j = 0; j < 4; j++)
 			A(i,j) = A0*B(0,j) + A1*B(1,j) + A2*B(2,j) + A3*B(3,j);
 	}
@@ -1,14 +1,19 @@
 #ifndef CG_MATRIX_H
 #define CG_MATRIX_H
 
-typedef double Mat3[9];
-typedef double Mat4[16];
-
+#include "arena.h"
 #include "vector.h"
+
+typedef Real Mat3[9];
+typedef Real Mat4[16];
+
 #include "quaternion.h"
 
+/* The matrices live in an arena; popped ones are kept for the next push */
 typedef struct MatrixStack {
 	struct Matrix *top;
+	struct Matrix *spare;
+	Arena *arena;
 } MatrixStack;
 
 typedef struct Matrix {
@@ -18,8 +23,7 @@ typedef struct Matrix {
 } Matrix;
 
 Vec3 mat3_transform(const Mat3 m, Vec3 v);
-MatrixStack *matstack_new(void);
-void matstack_destroy(MatrixStack *matstack);
+MatrixStack *matstack_new(Arena *arena);
 void matstack_pop(MatrixStack *stack);
 void matstack_push(MatrixStack *stack);
 Vec4 mat4_transform(const Mat4 m, Vec4 v);
@@ -1,12 +1,21 @@
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE /* For MAP_ANONYMOUS and MAP_NORESERVE */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <objreader/objreader.h>
 
 #include "mesh.h"
+#include "timer.h"
 
 /***********************
  * Parsing and loading *
@@ -187,23 +196,20 @@ static bool obj_second_pass(FILE *fd, Mesh *mesh)
 	return res == 0;
 }
 
-Mesh *mesh_load(const char *filename)
+static bool obj_load_generic(const char *filename, Mesh *mesh)
 {
 	FILE *fd;
-	Mesh *mesh;
 
 	if ((fd = fopen(filename, "r")) == NULL)
 	{
 		printf("Opening file %s failed: %s\n", filename, strerror(errno));
-		return NULL;
+		return false;
 	}
-	mesh = malloc(sizeof(Mesh));
-	mesh->kd_tree = NULL;
 	if (!obj_first_pass(fd, mesh))
 	{
 		printf("Error parsing file %s\n", filename);
 		fclose(fd);
-		return NULL;
+		return false;
 	}
 	fclose(fd);
 
@@ -217,235 +223,2411 @@ Mesh *mesh_load(const char *filename)
 	if ((fd = fopen(filename, "r")) == NULL)
 	{
 		printf("Opening file %s failed: %s\n", filename, strerror(errno));
-		return NULL;
+		return false;
 	}
 	if (!obj_second_pass(fd, mesh))
 	{
 		printf("Error parsing file %s\n", filename);
 		fclose(fd);
-		return NULL;
+		return false;
 	}
 	fclose(fd);
 
-	return mesh;
+	return true;
 }
 
-/********************
- * kd-tree building *
- ********************/
+/* The fast path: the whole file is mapped into memory and parsed in a single
+ * pass by hand, growing the arrays as it goes. It understands the common
+ * subset of OBJ; anything else is handed back to the generic reader above. */
 
-static KdNode *kd_node_new(void)
+typedef enum ObjStatus {
+	OBJ_OK,
+	OBJ_UNSUPPORTED, /* Valid perhaps, but for the generic reader */
+	OBJ_ERROR
+} ObjStatus;
+
+typedef struct ObjParser {
+	const char *p;
+	const char *end;
+	Mesh *mesh;
+	int max_vertices;
+	int max_normals;
+	int max_texcoords;
+	int max_triangles;
+	/* Where the triangles use negative indices, as 9*triangle + 3*kind +
+	 * corner. A chunk of the file resolves them against its own lists
+	 * only, so they are fixed up once the chunks before it are known. */
+	int num_relative;
+	int max_relative;
+	int *relative;
+} ObjParser;
+
+enum { OBJ_VERTEX, OBJ_TEXCOORD, OBJ_NORMAL };
+
+typedef struct ObjCorner {
+	int index[3]; /* Vertex, texcoord and normal */
+	unsigned relative; /* One bit for each of them */
+} ObjCorner;
+
+/* Makes room for one more element at the end of array */
+static void *grow_array(void *array, int count, int *capacity, size_t size)
 {
-	KdNode *node;
+	if (count < *capacity)
+		return array;
 
-	node = malloc(sizeof(KdNode));
-	node->leaf = false;
-	node->axis = -1;
-	node->location = HUGE_VAL;
-	node->left = node->right = NULL;
-	node->num_triangles = 0;
-	node->triangle = NULL;
+	*capacity = *capacity ? 2 * *capacity : 1024;
+	return realloc(array, *capacity * size);
+}
 
-	return node;
+static bool obj_at_eol(const ObjParser *op)
+{
+	return op->p == op->end || *op->p == '\n' || *op->p == '\r' ||
+			*op->p == '#';
 }
 
-static void split_kd_tree(const Vec3 *vertex_list, KdNode *tree, enum AXIS axis,
-		float location)
+static void obj_skip_blanks(ObjParser *op)
 {
-	int lefti, righti;
+	while (op->p < op->end && (*op->p == ' ' || *op->p == '\t'))
+		op->p++;
+}
 
-	tree->location = location;
-	tree->left = kd_node_new();
-	tree->right = kd_node_new();
-	for (int i = 0; i < tree->num_triangles; i++)
+static void obj_skip_line(ObjParser *op)
+{
+	while (op->p < op->end && *op->p != '\n' && *op->p != '\r')
+		op->p++;
+	if (op->p < op->end && *op->p == '\r')
+		op->p++;
+	if (op->p < op->end && *op->p == '\n')
+		op->p++;
+}
+
+/* The numbers that are exactly representable as doubles */
+static const double obj_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Reads a decimal number. Short ones, which is all of them in practice, are
+ * converted with a single multiplication or division of exact doubles, so
+ * the result is correctly rounded. The rest go through strtod(), on a
+ * terminated copy as the mapped file needn't end in a null. */
+static bool obj_parse_float(ObjParser *op, float *f)
+{
+	const char *p = op->p, *end = op->end;
+	uint64_t mantissa = 0;
+	int num_digits = 0, exponent = 0;
+	bool negative = false, any_digits = false;
+	double d;
+
+	obj_skip_blanks(op);
+	p = op->p;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
 	{
-		bool v_left[3]; /* v_left[i]: is vertex i left or right */
-		for (int j = 0; j < 3; j++)
+		any_digits = true;
+		if (num_digits < 19)
+		{
+			mantissa = 10*mantissa + (*p - '0');
+			num_digits += mantissa > 0;
+		} else
+			exponent++;
+	}
+	if (p < end && *p == '.')
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++)
 		{
-			Vec3 v = vertex_list[tree->triangle[i].vertex_index[j]];
-			if (axis == X_AXIS)
-				v_left[j] = v.x <= tree->location;
-			else if (axis == Y_AXIS)
-				v_left[j] = v.y <= tree->location;
-			else /* axis == Z_AXIS */
-				v_left[j] = v.z <= tree->location;
+			any_digits = true;
+			if (num_digits < 19)
+			{
+				mantissa = 10*mantissa + (*p - '0');
+				num_digits += mantissa > 0;
+				exponent--;
+			}
 		}
+	if (!any_digits)
+		return false;
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		int e = 0;
+		bool e_negative = false;
+
+		p++;
+		if (p < end && (*p == '-' || *p == '+'))
+			e_negative = *p++ == '-';
+		if (p == end || *p < '0' || *p > '9')
+			return false;
+		for (; p < end && *p >= '0' && *p <= '9'; p++)
+			if (e < 10000)
+				e = 10*e + (*p - '0');
+		exponent += e_negative ? -e : e;
+	}
 
-		if (v_left[0] || v_left[1] || v_left[2])
-			tree->left->num_triangles++;
-		if (!v_left[0] || !v_left[1] || !v_left[2])
-			tree->right->num_triangles++;
+	if (mantissa < (UINT64_C(1) << 53) && exponent >= -22 && exponent <= 22)
+	{
+		d = mantissa;
+		if (exponent < 0)
+			d /= obj_pow10[-exponent];
+		else
+			d *= obj_pow10[exponent];
+		if (negative)
+			d = -d;
+	} else
+	{
+		char small[64], *buffer = small;
+
+		if (p - op->p >= (ptrdiff_t) sizeof(small))
+			buffer = malloc(p - op->p + 1);
+		memcpy(buffer, op->p, p - op->p);
+		buffer[p - op->p] = '\0';
+		d = strtod(buffer, NULL);
+		if (buffer != small)
+			free(buffer);
 	}
 
-	tree->left->triangle = calloc(tree->left->num_triangles, sizeof(Triangle));
-	tree->right->triangle = calloc(tree->right->num_triangles, sizeof(Triangle));
+	op->p = p;
+	*f = d;
+	return true;
+}
 
-	lefti = righti = 0;
-	for (int i = 0; i < tree->num_triangles; i++)
+/* Reads a one based index, or a negative one relative to the end of the list
+ * so far, and turns it into a zero based one */
+static bool obj_parse_index(ObjParser *op, int count, int *index,
+		bool *relative)
+{
+	const char *p = op->p, *end = op->end;
+	bool negative = false;
+	long value = 0;
+
+	if (p < end && *p == '-')
 	{
-		bool v_left[3]; /* v_left[i]: is vertex i left or right */
-		for (int j = 0; j < 3; j++)
-		{
-			Vec3 v = vertex_list[tree->triangle[i].vertex_index[j]];
-			if (axis == X_AXIS)
-				v_left[j] = v.x <= tree->location;
-			else if (axis == Y_AXIS)
-				v_left[j] = v.y <= tree->location;
-			else /* axis == Z_AXIS */
-				v_left[j] = v.z <= tree->location;
-		}
+		negative = true;
+		p++;
+	}
+	if (p == end || *p < '0' || *p > '9')
+		return false;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		if (value <= INT_MAX)
+			value = 10*value + (*p - '0');
+	if (value == 0 || value > INT_MAX)
+		return false;
+
+	op->p = p;
+	*index = negative ? count - value : value - 1;
+	*relative = negative;
+	return true;
+}
+
+static bool obj_parse_corner_index(ObjParser *op, ObjCorner *corner,
+		int kind, int count)
+{
+	bool relative;
+
+	if (!obj_parse_index(op, count, &corner->index[kind], &relative))
+		return false;
+	if (relative)
+		corner->relative |= 1u << kind;
+	return true;
+}
+
+/* One of v, v/vt, v//vn or v/vt/vn */
+static bool obj_parse_corner(ObjParser *op, ObjCorner *corner)
+{
+	const Mesh *mesh = op->mesh;
+
+	corner->index[OBJ_TEXCOORD] = corner->index[OBJ_NORMAL] = -1;
+	corner->relative = 0;
+	if (!obj_parse_corner_index(op, corner, OBJ_VERTEX, mesh->num_vertices))
+		return false;
+	if (op->p == op->end || *op->p != '/')
+		return true;
+	op->p++;
+	if (op->p < op->end && *op->p != '/' && !obj_parse_corner_index(op,
+			corner, OBJ_TEXCOORD, mesh->num_texcoords))
+		return false;
+	if (op->p == op->end || *op->p != '/')
+		return true;
+	op->p++;
+	return obj_parse_corner_index(op, corner, OBJ_NORMAL, mesh->num_normals);
+}
+
+static void obj_add_triangle(ObjParser *op, const ObjCorner *corner[3])
+{
+	Mesh *mesh = op->mesh;
+	Triangle *tri;
 
-		if (v_left[0] || v_left[1] || v_left[2])
+	mesh->triangle = grow_array(mesh->triangle, mesh->num_triangles,
+			&op->max_triangles, sizeof(Triangle));
+	tri = &mesh->triangle[mesh->num_triangles];
+	for (int j = 0; j < 3; j++)
+	{
+		tri->vertex_index[j] = corner[j]->index[OBJ_VERTEX];
+		tri->texcoord_index[j] = corner[j]->index[OBJ_TEXCOORD];
+		tri->normal_index[j] = corner[j]->index[OBJ_NORMAL];
+		for (int kind = 0; kind < 3; kind++)
 		{
-			tree->left->triangle[lefti] = tree->triangle[i];
-			lefti++;
+			if (!(corner[j]->relative & 1u << kind))
+				continue;
+			op->relative = grow_array(op->relative, op->num_relative,
+					&op->max_relative, sizeof(int));
+			op->relative[op->num_relative++] =
+					9*mesh->num_triangles + 3*kind + j;
 		}
-		if (!v_left[0] || !v_left[1] || !v_left[2])
+	}
+	mesh->num_triangles++;
+}
+
+/* Faces with more than three corners are split into a fan of triangles */
+static bool obj_parse_face(ObjParser *op)
+{
+	ObjCorner first, previous, corner;
+	int num_corners = 0;
+
+	for (obj_skip_blanks(op); !obj_at_eol(op); obj_skip_blanks(op))
+	{
+		if (!obj_parse_corner(op, &corner))
+			return false;
+		if (num_corners >= 2)
 		{
-			tree->right->triangle[righti] = tree->triangle[i];
-			righti++;
-		}
+			const ObjCorner *fan[3] = {&first, &previous, &corner};
+
+			obj_add_triangle(op, fan);
+		} else if (num_corners == 0)
+			first = corner;
+		previous = corner;
+		num_corners++;
 	}
-	assert(tree->left->num_triangles == lefti);
-	assert(tree->right->num_triangles == righti);
-	free(tree->triangle);
-	tree->triangle = NULL;
-	tree->num_triangles = 0;
-	tree->leaf = false;
+
+	return num_corners >= 3;
 }
 
-static float calculate_cost(const Vec3 *vertex_list, const KdNode *tree,
-		enum AXIS axis,	float location, BBox tree_box)
+static bool obj_parse_floats(ObjParser *op, float *f, int min, int max)
 {
-	int left_tris, right_tris;
-	BBox left_box, right_box;
+	int n;
 
-	for (int i = 0; i < tree->num_triangles; i++)
+	for (n = 0; n < max; n++)
+	{
+		obj_skip_blanks(op);
+		if (obj_at_eol(op))
+			break;
+		if (!obj_parse_float(op, &f[n]))
+			return false;
+	}
+
+	return n >= min;
+}
+
+static bool keyword_is(const char *word, size_t length, const char *keyword)
+{
+	return length == strlen(keyword) && memcmp(word, keyword, length) == 0;
+}
+
+static ObjStatus obj_parse_line(ObjParser *op)
+{
+	Mesh *mesh = op->mesh;
+	const char *word;
+	size_t length;
+	float f[4];
+
+	obj_skip_blanks(op);
+	if (obj_at_eol(op))
+		return OBJ_OK;
+
+	word = op->p;
+	while (op->p < op->end && *op->p != ' ' && *op->p != '\t' &&
+			!obj_at_eol(op))
+		op->p++;
+	length = op->p - word;
+
+	if (keyword_is(word, length, "v"))
+	{
+		if (!obj_parse_floats(op, f, 3, 4))
+			return OBJ_ERROR;
+		mesh->vertex = grow_array(mesh->vertex, mesh->num_vertices,
+				&op->max_vertices, sizeof(Vec3));
+		mesh->vertex[mesh->num_vertices++] = (Vec3) {f[0], f[1], f[2]};
+	} else if (keyword_is(word, length, "vn"))
+	{
+		if (!obj_parse_floats(op, f, 3, 3))
+			return OBJ_ERROR;
+		mesh->normal = grow_array(mesh->normal, mesh->num_normals,
+				&op->max_normals, sizeof(Vec3));
+		mesh->normal[mesh->num_normals++] = (Vec3) {f[0], f[1], f[2]};
+	} else if (keyword_is(word, length, "vt"))
+	{
+		/* v is optional, and 0 if left out */
+		f[1] = 0;
+		if (!obj_parse_floats(op, f, 1, 3))
+			return OBJ_ERROR;
+		mesh->texcoord = grow_array(mesh->texcoord, mesh->num_texcoords,
+				&op->max_texcoords, sizeof(TexCoord));
+		mesh->texcoord[mesh->num_texcoords++] = (TexCoord) {f[0], f[1]};
+	} else if (keyword_is(word, length, "f"))
+	{
+		if (!obj_parse_face(op))
+			return OBJ_ERROR;
+	} else if (keyword_is(word, length, "o") ||
+			keyword_is(word, length, "g") ||
+			keyword_is(word, length, "s") ||
+			keyword_is(word, length, "l") ||
+			keyword_is(word, length, "usemtl") ||
+			keyword_is(word, length, "mtllib"))
+	{
+		/* Not used by the renderer */
+		while (!obj_at_eol(op))
+			op->p++;
+	} else
+		return OBJ_UNSUPPORTED;
+
+	obj_skip_blanks(op);
+	return obj_at_eol(op) ? OBJ_OK : OBJ_ERROR;
+}
+
+/* Trims the arrays to size, and checks that the faces only refer to
+ * vertices, normals and texture coordinates that exist */
+static bool obj_finish(Mesh *mesh)
+{
+	mesh->has_normals = mesh->num_normals > 0;
+	mesh->has_texcoords = mesh->num_texcoords > 0;
+	if (mesh->num_vertices > 0)
+		mesh->vertex = realloc(mesh->vertex,
+				mesh->num_vertices * sizeof(mesh->vertex[0]));
+	if (mesh->num_normals > 0)
+		mesh->normal = realloc(mesh->normal,
+				mesh->num_normals * sizeof(mesh->normal[0]));
+	if (mesh->num_texcoords > 0)
+		mesh->texcoord = realloc(mesh->texcoord,
+				mesh->num_texcoords * sizeof(mesh->texcoord[0]));
+	if (mesh->num_triangles > 0)
+		mesh->triangle = realloc(mesh->triangle,
+				mesh->num_triangles * sizeof(mesh->triangle[0]));
+
+	for (int i = 0; i < mesh->num_triangles; i++)
 	{
-		Triangle tri = tree->triangle[i];
-		bool v_left[3]; /* v_left[i]: is vertex i left or right */
+		const Triangle *tri = &mesh->triangle[i];
+
 		for (int j = 0; j < 3; j++)
 		{
-			Vec3 v = vertex_list[tri.vertex_index[j]];
-			if (axis == X_AXIS)
-				v_left[j] = v.x <= location;
-			else if (axis == Y_AXIS)
-				v_left[j] = v.y <= location;
-			else /* axis == Z_AXIS */
-				v_left[j] = v.z <= location;
+			const int v = tri->vertex_index[j], n = tri->normal_index[j];
+			const int t = tri->texcoord_index[j];
+
+			if (v < 0 || v >= mesh->num_vertices ||
+					n < -1 || n >= mesh->num_normals ||
+					t < -1 || t >= mesh->num_texcoords)
+				return false;
 		}
+	}
+
+	return true;
+}
+
+static void mesh_free_arrays(Mesh *mesh)
+{
+	free(mesh->vertex);
+	free(mesh->normal);
+	free(mesh->texcoord);
+	free(mesh->triangle);
+	mesh->vertex = mesh->normal = NULL;
+	mesh->texcoord = NULL;
+	mesh->triangle = NULL;
+	mesh->num_vertices = mesh->num_normals = mesh->num_texcoords = 0;
+	mesh->num_triangles = 0;
+}
+
+static void obj_parser_init(ObjParser *op, const char *begin,
+		const char *end, Mesh *mesh)
+{
+	op->p = begin;
+	op->end = end;
+	op->mesh = mesh;
+	op->max_vertices = op->max_normals = op->max_texcoords = 0;
+	op->max_triangles = 0;
+	op->num_relative = op->max_relative = 0;
+	op->relative = NULL;
+}
+
+/* Leaves op->p where it stopped, if it didn't reach the end */
+static ObjStatus obj_parse_lines(ObjParser *op)
+{
+	ObjStatus status = OBJ_OK;
 
-		if (v_left[0] || v_left[1] || v_left[2])
-			left_tris++;
-		if (!v_left[0] || !v_left[1] || !v_left[2])
-			right_tris++;
+	while (op->p < op->end && status == OBJ_OK)
+	{
+		status = obj_parse_line(op);
+		if (status == OBJ_OK)
+			obj_skip_line(op);
 	}
 
-	bbox_split(tree_box, axis, location, &left_box, &right_box);
-	return left_tris * bbox_surface_area(left_box) +
-			right_tris * bbox_surface_area(right_box);
+	return status;
+}
+
+/* Files larger than this are split into chunks that are parsed concurrently,
+ * as many as there are processors */
+#define OBJ_CHUNK_SIZE (4 << 20)
+#define OBJ_MAX_CHUNKS 64
+
+typedef struct ObjChunk {
+	ObjParser parser; /* Into the chunk's own mesh */
+	Mesh mesh;
+	ObjStatus status;
+	Mesh *target;
+	int base[3]; /* Where its vertices, texcoords and normals go in target */
+	int triangle_base;
+} ObjChunk;
+
+static void *obj_parse_chunk(void *data)
+{
+	ObjChunk *chunk = (ObjChunk *) data;
+
+	chunk->status = obj_parse_lines(&chunk->parser);
 
+	return NULL;
 }
 
-static void build_kd_subtree(const Vec3 *vertex_list, KdNode *tree, int depth,
-		enum AXIS axis, BBox bbox)
+/* Copies the chunk into its place in the target, and adds the chunk's offsets
+ * to the indices that were relative to it */
+static void *obj_merge_chunk(void *data)
 {
-	enum AXIS next_axis;
-	float best_cost, best_location;
-	BBox left_box, right_box;
+	ObjChunk *chunk = (ObjChunk *) data;
+	const Mesh *mesh = &chunk->mesh;
+	Mesh *target = chunk->target;
+	Triangle *triangle = &target->triangle[chunk->triangle_base];
+
+	if (mesh->num_vertices > 0)
+		memcpy(&target->vertex[chunk->base[OBJ_VERTEX]], mesh->vertex,
+				mesh->num_vertices * sizeof(mesh->vertex[0]));
+	if (mesh->num_texcoords > 0)
+		memcpy(&target->texcoord[chunk->base[OBJ_TEXCOORD]],
+				mesh->texcoord,
+				mesh->num_texcoords * sizeof(mesh->texcoord[0]));
+	if (mesh->num_normals > 0)
+		memcpy(&target->normal[chunk->base[OBJ_NORMAL]], mesh->normal,
+				mesh->num_normals * sizeof(mesh->normal[0]));
+	if (mesh->num_triangles > 0)
+		memcpy(triangle, mesh->triangle,
+				mesh->num_triangles * sizeof(mesh->triangle[0]));
+
+	for (int i = 0; i < chunk->parser.num_relative; i++)
+	{
+		const int r = chunk->parser.relative[i];
+		const int kind = r / 3 % 3, j = r % 3;
+		Triangle *tri = &triangle[r / 9];
+
+		if (kind == OBJ_VERTEX)
+			tri->vertex_index[j] += chunk->base[OBJ_VERTEX];
+		else if (kind == OBJ_TEXCOORD)
+			tri->texcoord_index[j] += chunk->base[OBJ_TEXCOORD];
+		else
+			tri->normal_index[j] += chunk->base[OBJ_NORMAL];
+	}
+
+	return NULL;
+}
+
+/* Runs task on every chunk, each in its own thread but the first */
+static void obj_run_chunks(void *(*task)(void *), ObjChunk *chunk, int n)
+{
+	pthread_t thread[OBJ_MAX_CHUNKS];
+	bool started[OBJ_MAX_CHUNKS];
 
-	if (tree->num_triangles <= 10 || depth == 8)
+	for (int i = 1; i < n; i++)
+		started[i] = !pthread_create(&thread[i], NULL, task, &chunk[i]);
+	task(&chunk[0]);
+	for (int i = 1; i < n; i++)
 	{
-		tree->leaf = true;
-		tree->left = tree->right = NULL;
-		return;
+		if (started[i])
+			pthread_join(thread[i], NULL);
+		else
+			task(&chunk[i]);
 	}
-	tree->axis = axis;
+}
 
-	/* Determine the optimum location using the surface area heuristic */
-	best_cost = HUGE_VAL;
-	best_location = 0;
-	for (int i = 0; i < tree->num_triangles; i++)
+/* Every chunk but the first starts right after a line break */
+static int obj_split_chunks(const char *data, size_t size, ObjChunk *chunk)
+{
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int n = MIN(MAX(num_cpus, 1), OBJ_MAX_CHUNKS);
+	const char *begin = data, *end = data + size;
+
+	n = MIN(n, (int) (size / OBJ_CHUNK_SIZE));
+	n = MAX(n, 1);
+	for (int i = 0; i < n; i++)
 	{
-		Triangle tri = tree->triangle[i];
-		for (int j = 0; j < 3; j++)
-		{
-			float loc, cost;
-			Vec3 v = vertex_list[tri.vertex_index[j]];
+		const char *chunk_end = data + (i + 1) * (size / n);
+
+		if (i == n - 1)
+			chunk_end = end;
+		else if (chunk_end < begin)
+			chunk_end = begin;
+		while (chunk_end < end && chunk_end[-1] != '\n')
+			chunk_end++;
+		memset(&chunk[i].mesh, 0, sizeof(Mesh));
+		obj_parser_init(&chunk[i].parser, begin, chunk_end,
+				&chunk[i].mesh);
+		begin = chunk_end;
+	}
 
-			if (axis == X_AXIS)
-				loc = v.x;
-			else if (axis == Y_AXIS)
-				loc = v.y;
-			else
-				loc = v.z;
+	return n;
+}
 
-			cost = calculate_cost(vertex_list, tree, axis, loc, bbox);
-			if (cost < best_cost)
-			{
-				best_cost = cost;
-				best_location = loc;
-			}
+static void obj_free_chunks(ObjChunk *chunk, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		mesh_free_arrays(&chunk[i].mesh);
+		free(chunk[i].parser.relative);
+	}
+}
+
+static ObjStatus obj_parse(const char *data, size_t size, Mesh *mesh,
+		const char *filename, int *num_chunks)
+{
+	ObjChunk chunk[OBJ_MAX_CHUNKS];
+	ObjStatus status = OBJ_OK;
+	int n, error = -1;
+
+	*num_chunks = n = obj_split_chunks(data, size, chunk);
+	obj_run_chunks(obj_parse_chunk, chunk, n);
+	for (int i = n - 1; i >= 0; i--)
+	{
+		if (chunk[i].status == OBJ_UNSUPPORTED)
+			status = OBJ_UNSUPPORTED;
+		else if (chunk[i].status == OBJ_ERROR)
+			error = i;
+	}
+	if (status == OBJ_OK && error >= 0)
+	{
+		const char *p = chunk[error].parser.p;
+		int line = 1;
+
+		for (const char *q = data; q < p; q++)
+			line += *q == '\n';
+		printf("Error parsing file %s on line %d\n", filename, line);
+		status = OBJ_ERROR;
+	}
+	if (status != OBJ_OK)
+	{
+		obj_free_chunks(chunk, n);
+		return status;
+	}
+
+	if (n == 1)
+	{
+		/* Nothing to merge, and mesh is still empty */
+		*mesh = chunk[0].mesh;
+		memset(&chunk[0].mesh, 0, sizeof(Mesh));
+	} else
+	{
+		/* The prefix sums of the counts give every chunk its place */
+		for (int i = 0; i < n; i++)
+		{
+			const Mesh *m = &chunk[i].mesh;
+
+			chunk[i].target = mesh;
+			chunk[i].base[OBJ_VERTEX] = mesh->num_vertices;
+			chunk[i].base[OBJ_TEXCOORD] = mesh->num_texcoords;
+			chunk[i].base[OBJ_NORMAL] = mesh->num_normals;
+			chunk[i].triangle_base = mesh->num_triangles;
+			mesh->num_vertices += m->num_vertices;
+			mesh->num_texcoords += m->num_texcoords;
+			mesh->num_normals += m->num_normals;
+			mesh->num_triangles += m->num_triangles;
 		}
+		if (mesh->num_vertices > 0)
+			mesh->vertex = malloc(mesh->num_vertices *
+					sizeof(mesh->vertex[0]));
+		if (mesh->num_texcoords > 0)
+			mesh->texcoord = malloc(mesh->num_texcoords *
+					sizeof(mesh->texcoord[0]));
+		if (mesh->num_normals > 0)
+			mesh->normal = malloc(mesh->num_normals *
+					sizeof(mesh->normal[0]));
+		if (mesh->num_triangles > 0)
+			mesh->triangle = malloc(mesh->num_triangles *
+					sizeof(mesh->triangle[0]));
+		obj_run_chunks(obj_merge_chunk, chunk, n);
 	}
+	obj_free_chunks(chunk, n);
 
-	/* Now, split the tree in twain at this location */
-	split_kd_tree(vertex_list, tree, axis, best_location + 1e-3);
-	bbox_split(bbox, axis, best_location, &left_box, &right_box);
+	if (!obj_finish(mesh))
+	{
+		printf("Error parsing file %s: index out of range\n", filename);
+		mesh_free_arrays(mesh);
+		return OBJ_ERROR;
+	}
+
+	return OBJ_OK;
+}
+
+/**************************
+ * Welding and compaction *
+ **************************/
+
+static uint32_t hash_bytes(const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	uint32_t h = 2166136261u; /* FNV-1a */
+
+	for (size_t i = 0; i < size; i++)
+		h = (h ^ p[i]) * 16777619u;
 
-	switch (axis)
+	return h;
+}
+
+/* Removes the duplicates from an array of count elements of size bytes each,
+ * keeping the first of every kind in order, and fills remap with the new
+ * index of every old element. Returns the new count. Elements have to be
+ * bitwise identical to be merged. */
+static int weld(void *array, int count, size_t size, int *remap)
+{
+	char *a = array;
+	int capacity = 16, n = 0;
+	int *table;
+
+	while (capacity < 2 * count)
+		capacity *= 2;
+	table = malloc(capacity * sizeof(int));
+	memset(table, -1, capacity * sizeof(int));
+
+	for (int i = 0; i < count; i++)
 	{
-	case X_AXIS:
-		next_axis = Y_AXIS;
-		break;
-	case Y_AXIS:
-		next_axis = Z_AXIS;
-		break;
-	case Z_AXIS:
-		next_axis = X_AXIS;
-		break;
-	default:
-		printf("Invalid axis %d\n", axis);
-		exit(1);
-		break;
+		const char *element = a + i * size;
+		uint32_t h = hash_bytes(element, size) & (capacity - 1);
+
+		while (table[h] >= 0 && memcmp(a + table[h] * size, element, size))
+			h = (h + 1) & (capacity - 1);
+		if (table[h] < 0)
+		{
+			memmove(a + n * size, element, size);
+			table[h] = n++;
+		}
+		remap[i] = table[h];
 	}
 
-	build_kd_subtree(vertex_list, tree->left, depth + 1, next_axis, left_box);
-	build_kd_subtree(vertex_list, tree->right, depth + 1, next_axis, right_box);
+	free(table);
+	return n;
 }
 
-void mesh_build_kd_tree(Mesh *mesh)
+/* The memory taken by the vertices, normals, texcoords and triangles */
+static size_t mesh_geometry_size(const Mesh *mesh)
 {
-	BBox bbox;
+	size_t size = mesh->num_vertices * sizeof(Vec3) +
+			mesh->num_normals * sizeof(Vec3) +
+			mesh->num_texcoords * sizeof(TexCoord);
 
-	bbox.xmin = bbox.ymin = bbox.zmin =  HUGE_VAL;
-	bbox.xmax = bbox.ymax = bbox.zmax = -HUGE_VAL;
+	if (mesh->triangle)
+		size += mesh->num_triangles * sizeof(Triangle);
+	else
+		size += 3 * mesh->num_triangles *
+				(mesh->index16 ? sizeof(uint16_t) : sizeof(uint32_t));
+
+	return size;
+}
+
+static bool is_degenerate(const Mesh *mesh, const Triangle *tri)
+{
+	const int *v = tri->vertex_index;
+	Vec3 e1, e2, n;
+
+	if (v[0] == v[1] || v[1] == v[2] || v[2] == v[0])
+		return true;
+
+	e1 = vec3_sub(mesh->vertex[v[1]], mesh->vertex[v[0]]);
+	e2 = vec3_sub(mesh->vertex[v[2]], mesh->vertex[v[0]]);
+	n = vec3_cross(e1, e2);
+	return n.x == 0 && n.y == 0 && n.z == 0;
+}
+
+/* Merges identical vertices, normals and texcoords, and drops the triangles
+ * that have collapsed or have no area */
+static void mesh_weld(Mesh *mesh)
+{
+	int *vertex_remap, *normal_remap, *texcoord_remap;
+	int n = 0;
+
+	vertex_remap = malloc(MAX(mesh->num_vertices, 1) * sizeof(int));
+	normal_remap = malloc(MAX(mesh->num_normals, 1) * sizeof(int));
+	texcoord_remap = malloc(MAX(mesh->num_texcoords, 1) * sizeof(int));
+	mesh->num_vertices = weld(mesh->vertex, mesh->num_vertices, sizeof(Vec3),
+			vertex_remap);
+	mesh->num_normals = weld(mesh->normal, mesh->num_normals, sizeof(Vec3),
+			normal_remap);
+	mesh->num_texcoords = weld(mesh->texcoord, mesh->num_texcoords,
+			sizeof(TexCoord), texcoord_remap);
 
 	for (int i = 0; i < mesh->num_triangles; i++)
 	{
 		Triangle tri = mesh->triangle[i];
+
 		for (int j = 0; j < 3; j++)
 		{
-			Vec3 v = mesh->vertex[tri.vertex_index[j]];
-			if (v.x < bbox.xmin)
-				bbox.xmin = v.x;
-			if (v.x > bbox.xmax)
-				bbox.xmax = v.x;
-			if (v.y < bbox.ymin)
-				bbox.ymin = v.y;
-			if (v.y > bbox.ymax)
-				bbox.ymax = v.y;
-			if (v.z < bbox.zmin)
-				bbox.zmin = v.z;
-			if (v.z > bbox.zmax)
-				bbox.zmax = v.z;
+			tri.vertex_index[j] = vertex_remap[tri.vertex_index[j]];
+			if (tri.normal_index[j] >= 0)
+				tri.normal_index[j] = normal_remap[tri.normal_index[j]];
+			if (tri.texcoord_index[j] >= 0)
+				tri.texcoord_index[j] = texcoord_remap[tri.texcoord_index[j]];
+		}
+		if (!is_degenerate(mesh, &tri))
+			mesh->triangle[n++] = tri;
+	}
+	mesh->num_triangles = n;
+
+	mesh->vertex = realloc(mesh->vertex,
+			MAX(mesh->num_vertices, 1) * sizeof(Vec3));
+	if (mesh->normal)
+		mesh->normal = realloc(mesh->normal,
+				MAX(mesh->num_normals, 1) * sizeof(Vec3));
+	if (mesh->texcoord)
+		mesh->texcoord = realloc(mesh->texcoord,
+				MAX(mesh->num_texcoords, 1) * sizeof(TexCoord));
+
+	free(vertex_remap);
+	free(normal_remap);
+	free(texcoord_remap);
+}
+
+/* Gives every distinct combination of vertex, normal and texcoord that a
+ * corner uses its own index, if that takes less memory than the separate
+ * indices. Corners without a normal or texcoord where others have one rule
+ * it out. */
+static void mesh_unify_indices(Mesh *mesh)
+{
+	const int num_corners = 3 * mesh->num_triangles;
+	int (*corner)[3];
+	int *remap, num_unified;
+	size_t unified_size, index_size;
+	Vec3 *vertex, *normal = NULL;
+	TexCoord *texcoord = NULL;
+
+	for (int i = 0; i < mesh->num_triangles; i++)
+		for (int j = 0; j < 3; j++)
+			if ((mesh->triangle[i].normal_index[j] < 0) ==
+					(mesh->num_normals > 0) ||
+					(mesh->triangle[i].texcoord_index[j] < 0) ==
+					(mesh->num_texcoords > 0))
+				return;
+
+	corner = malloc(MAX(num_corners, 1) * sizeof(corner[0]));
+	remap = malloc(MAX(num_corners, 1) * sizeof(int));
+	for (int i = 0; i < mesh->num_triangles; i++)
+		for (int j = 0; j < 3; j++)
+		{
+			corner[3*i + j][0] = mesh->triangle[i].vertex_index[j];
+			corner[3*i + j][1] = mesh->triangle[i].normal_index[j];
+			corner[3*i + j][2] = mesh->triangle[i].texcoord_index[j];
+		}
+	num_unified = weld(corner, num_corners, sizeof(corner[0]), remap);
+
+	index_size = num_unified <= 1 << 16 ? sizeof(uint16_t) : sizeof(uint32_t);
+	unified_size = num_unified * (sizeof(Vec3) +
+			(mesh->num_normals > 0 ? sizeof(Vec3) : 0) +
+			(mesh->num_texcoords > 0 ? sizeof(TexCoord) : 0)) +
+			num_corners * index_size;
+	if (unified_size >= mesh_geometry_size(mesh))
+	{
+		free(corner);
+		free(remap);
+		return;
+	}
+
+	vertex = malloc(MAX(num_unified, 1) * sizeof(Vec3));
+	if (mesh->num_normals > 0)
+		normal = malloc(num_unified * sizeof(Vec3));
+	if (mesh->num_texcoords > 0)
+		texcoord = malloc(num_unified * sizeof(TexCoord));
+	for (int k = 0; k < num_unified; k++)
+	{
+		vertex[k] = mesh->vertex[corner[k][0]];
+		if (normal)
+			normal[k] = mesh->normal[corner[k][1]];
+		if (texcoord)
+			texcoord[k] = mesh->texcoord[corner[k][2]];
+	}
+
+	if (index_size == sizeof(uint16_t))
+	{
+		mesh->index16 = malloc(MAX(num_corners, 1) * sizeof(uint16_t));
+		for (int i = 0; i < num_corners; i++)
+			mesh->index16[i] = remap[i];
+	} else
+	{
+		mesh->index32 = malloc(MAX(num_corners, 1) * sizeof(uint32_t));
+		for (int i = 0; i < num_corners; i++)
+			mesh->index32[i] = remap[i];
+	}
+
+	free(mesh->vertex);
+	free(mesh->normal);
+	free(mesh->texcoord);
+	free(mesh->triangle);
+	mesh->vertex = vertex;
+	mesh->normal = normal;
+	mesh->texcoord = texcoord;
+	mesh->triangle = NULL;
+	mesh->num_vertices = num_unified;
+	mesh->num_normals = normal ? num_unified : 0;
+	mesh->num_texcoords = texcoord ? num_unified : 0;
+
+	free(corner);
+	free(remap);
+}
+
+/* Shrinks a freshly loaded mesh. This has to happen before its kd-tree is
+ * built, since triangles may be dropped. */
+void mesh_optimise(Mesh *mesh)
+{
+	const size_t before = mesh_geometry_size(mesh);
+	const int num_vertices = mesh->num_vertices;
+	const int num_triangles = mesh->num_triangles;
+
+	/* Mapped files are read only, and already compact if they want to be */
+	if (mesh->triangle == NULL || mesh->kd_node != NULL || mesh->file != NULL)
+		return;
+
+	mesh_weld(mesh);
+	mesh_unify_indices(mesh);
+	if (mesh->triangle)
+		mesh->triangle = realloc(mesh->triangle,
+				MAX(mesh->num_triangles, 1) * sizeof(Triangle));
+
+	printf("Optimised %s: %d to %d vertices, %d to %d triangles, "
+			"%.2f to %.2f MB%s\n", mesh->name ? mesh->name : "mesh",
+			num_vertices, mesh->num_vertices,
+			num_triangles, mesh->num_triangles,
+			before/1e6, mesh_geometry_size(mesh)/1e6,
+			mesh->index16 ? ", 16-bit indices" :
+			(mesh->index32 ? ", unified indices" : ""));
+}
+
+/*********************
+ * Binary mesh files *
+ *********************/
+
+/* A binary mesh file holds the arrays of a mesh, kd-tree included, exactly as
+ * they are laid out in memory. Each one starts at an offset that is a
+ * multiple of MESH_FILE_ALIGN, so the file can be mapped and used as it is,
+ * without any parsing or fixing up. The header records everything that
+ * layout depends on, and files from a differently configured build are
+ * refused rather than misread. */
+#define MESH_FILE_MAGIC "CGMESH\r\n"
+enum { MESH_FILE_VERSION = 2, MESH_FILE_ALIGN = 64 };
+
+typedef struct MeshFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order; /* 0x01020304 as written */
+	uint32_t real_size;
+	uint32_t kd_simd_width;
+	int32_t num_vertices;
+	int32_t num_normals;
+	int32_t num_texcoords;
+	int32_t num_triangles;
+	int32_t num_kd_nodes;
+	int32_t num_kd_indices;
+	int32_t index_size; /* 0 if the triangles are stored as Triangles */
+	int32_t unused;
+	/* Offsets of the arrays from the start of the file */
+	uint64_t vertex;
+	uint64_t normal;
+	uint64_t texcoord;
+	uint64_t triangle;
+	uint64_t index16;
+	uint64_t index32;
+	uint64_t kd_node;
+	uint64_t kd_index;
+	uint64_t kd_block;
+} MeshFileHeader;
+
+static bool is_mesh_file(const void *data, size_t size)
+{
+	return size >= sizeof(MeshFileHeader) &&
+			memcmp(data, MESH_FILE_MAGIC, 8) == 0;
+}
+
+/* Points the mesh's arrays into the mapped file */
+static bool mesh_map_file(Mesh *mesh, char *data, size_t size,
+		const char *filename)
+{
+	MeshFileHeader header;
+
+	memcpy(&header, data, sizeof(header));
+	if (header.version != MESH_FILE_VERSION ||
+			header.byte_order != 0x01020304 ||
+			header.real_size != sizeof(Real) ||
+			header.kd_simd_width != KD_SIMD_WIDTH ||
+			(header.index_size != 0 && header.index_size != 2 &&
+			header.index_size != 4) ||
+			header.num_kd_indices % KD_SIMD_WIDTH != 0 ||
+			/* The arrays are used in place, so they had better be
+			 * aligned */
+			(header.vertex | header.normal | header.texcoord |
+			header.triangle | header.index16 | header.index32 |
+			header.kd_node | header.kd_index | header.kd_block) %
+			MESH_FILE_ALIGN != 0)
+	{
+		printf("%s was written by a differently configured build, "
+				"convert it again\n", filename);
+		return false;
+	}
+
+#define MAP_ARRAY(field, count, type) \
+	do { \
+		if ((count) < 0 || header.field > size || \
+				(uint64_t) (count) * sizeof(type) > size - header.field) \
+		{ \
+			printf("%s is truncated\n", filename); \
+			return false; \
+		} \
+		mesh->field = (count) > 0 ? (type *) (data + header.field) : NULL; \
+	} while (0)
+
+	MAP_ARRAY(vertex, header.num_vertices, Vec3);
+	MAP_ARRAY(normal, header.num_normals, Vec3);
+	MAP_ARRAY(texcoord, header.num_texcoords, TexCoord);
+	MAP_ARRAY(triangle, header.index_size == 0 ? header.num_triangles : 0,
+			Triangle);
+	MAP_ARRAY(index16, header.index_size == 2 ?
+			3 * (int64_t) header.num_triangles : 0, uint16_t);
+	MAP_ARRAY(index32, header.index_size == 4 ?
+			3 * (int64_t) header.num_triangles : 0, uint32_t);
+	MAP_ARRAY(kd_node, header.num_kd_nodes, KdFlatNode);
+	MAP_ARRAY(kd_index, header.num_kd_indices, uint32_t);
+	MAP_ARRAY(kd_block, header.num_kd_indices / KD_SIMD_WIDTH,
+			KdTriangleBlock);
+#undef MAP_ARRAY
+
+	/* Traversal starts at the root, and goes on to its children or its
+	 * triangles */
+	if (header.num_kd_nodes > 0)
+	{
+		const KdFlatNode *root = &mesh->kd_node[0];
+		const uint64_t children = KD_NODE_OFFSET(root);
+
+		if (root->flags == KD_UNBUILT || (KD_NODE_AXIS(root) == KD_LEAF ?
+				children + root->u.num_triangles >
+				(uint64_t) header.num_kd_indices :
+				children + 2 > (uint64_t) header.num_kd_nodes))
+		{
+			printf("%s is truncated\n", filename);
+			return false;
 		}
+	} else if (header.num_kd_indices > 0)
+	{
+		printf("%s is truncated\n", filename);
+		return false;
 	}
-	mesh->kd_tree = kd_node_new();
-	mesh->kd_tree->num_triangles = mesh->num_triangles;
-	mesh->kd_tree->triangle = calloc(mesh->kd_tree->num_triangles,
-			sizeof(Triangle));
-	memcpy(mesh->kd_tree->triangle, mesh->triangle,
-			mesh->num_triangles * sizeof(Triangle));
-	build_kd_subtree(mesh->vertex, mesh->kd_tree, 0, X_AXIS, bbox);
+
+	mesh->num_vertices = header.num_vertices;
+	mesh->num_normals = header.num_normals;
+	mesh->has_normals = header.num_normals > 0;
+	mesh->num_texcoords = header.num_texcoords;
+	mesh->has_texcoords = header.num_texcoords > 0;
+	mesh->num_triangles = header.num_triangles;
+	mesh->num_kd_nodes = header.num_kd_nodes;
+	mesh->num_kd_indices = header.num_kd_indices;
+	mesh->file = data;
+	mesh->file_size = size;
+
+	return true;
+}
+
+/* Where the next array goes, given the end of the previous one */
+static uint64_t mesh_file_place(uint64_t *end, size_t size)
+{
+	uint64_t offset = (*end + MESH_FILE_ALIGN - 1) / MESH_FILE_ALIGN *
+			MESH_FILE_ALIGN;
+
+	*end = offset + size;
+	return offset;
+}
+
+static bool mesh_file_write(FILE *fd, uint64_t *position, uint64_t offset,
+		const void *array, size_t size)
+{
+	static const char zeroes[MESH_FILE_ALIGN];
+
+	assert(offset - *position < MESH_FILE_ALIGN);
+	if (fwrite(zeroes, 1, offset - *position, fd) != offset - *position ||
+			fwrite(array, 1, size, fd) != size)
+		return false;
+	*position = offset + size;
+
+	return true;
+}
+
+bool mesh_save(const Mesh *mesh, const char *filename)
+{
+	MeshFileHeader header;
+	uint64_t end = sizeof(header), position = 0;
+	const size_t num_blocks = mesh->num_kd_indices / KD_SIMD_WIDTH;
+	const size_t num_corners = 3 * mesh->num_triangles;
+	const size_t num_triangles = mesh->triangle ? mesh->num_triangles : 0;
+	bool ok;
+	FILE *fd;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MESH_FILE_MAGIC, 8);
+	header.version = MESH_FILE_VERSION;
+	header.byte_order = 0x01020304;
+	header.real_size = sizeof(Real);
+	header.kd_simd_width = KD_SIMD_WIDTH;
+	header.num_vertices = mesh->num_vertices;
+	header.num_normals = mesh->num_normals;
+	header.num_texcoords = mesh->num_texcoords;
+	header.num_triangles = mesh->num_triangles;
+	header.num_kd_nodes = mesh->num_kd_nodes;
+	header.num_kd_indices = mesh->num_kd_indices;
+	header.index_size = mesh->index16 ? 2 : (mesh->index32 ? 4 : 0);
+	header.vertex = mesh_file_place(&end,
+			mesh->num_vertices * sizeof(Vec3));
+	header.normal = mesh_file_place(&end,
+			mesh->num_normals * sizeof(Vec3));
+	header.texcoord = mesh_file_place(&end,
+			mesh->num_texcoords * sizeof(TexCoord));
+	header.triangle = mesh_file_place(&end, num_triangles * sizeof(Triangle));
+	header.index16 = mesh_file_place(&end,
+			(mesh->index16 ? num_corners : 0) * sizeof(uint16_t));
+	header.index32 = mesh_file_place(&end,
+			(mesh->index32 ? num_corners : 0) * sizeof(uint32_t));
+	header.kd_node = mesh_file_place(&end,
+			mesh->num_kd_nodes * sizeof(KdFlatNode));
+	header.kd_index = mesh_file_place(&end,
+			mesh->num_kd_indices * sizeof(uint32_t));
+	header.kd_block = mesh_file_place(&end,
+			num_blocks * sizeof(KdTriangleBlock));
+
+	if ((fd = fopen(filename, "wb")) == NULL)
+	{
+		printf("Opening file %s failed: %s\n", filename, strerror(errno));
+		return false;
+	}
+	ok = mesh_file_write(fd, &position, 0, &header, sizeof(header)) &&
+		mesh_file_write(fd, &position, header.vertex, mesh->vertex,
+				mesh->num_vertices * sizeof(Vec3)) &&
+		mesh_file_write(fd, &position, header.normal, mesh->normal,
+				mesh->num_normals * sizeof(Vec3)) &&
+		mesh_file_write(fd, &position, header.texcoord, mesh->texcoord,
+				mesh->num_texcoords * sizeof(TexCoord)) &&
+		mesh_file_write(fd, &position, header.triangle, mesh->triangle,
+				num_triangles * sizeof(Triangle)) &&
+		mesh_file_write(fd, &position, header.index16, mesh->index16,
+				(mesh->index16 ? num_corners : 0) * sizeof(uint16_t)) &&
+		mesh_file_write(fd, &position, header.index32, mesh->index32,
+				(mesh->index32 ? num_corners : 0) * sizeof(uint32_t)) &&
+		mesh_file_write(fd, &position, header.kd_node, mesh->kd_node,
+				mesh->num_kd_nodes * sizeof(KdFlatNode)) &&
+		mesh_file_write(fd, &position, header.kd_index, mesh->kd_index,
+				mesh->num_kd_indices * sizeof(uint32_t)) &&
+		mesh_file_write(fd, &position, header.kd_block, mesh->kd_block,
+				num_blocks * sizeof(KdTriangleBlock));
+	if (fclose(fd) != 0)
+		ok = false;
+	if (!ok)
+		printf("Writing file %s failed: %s\n", filename, strerror(errno));
+
+	return ok;
+}
+
+/* Maps the whole file read only. Empty files give a NULL mapping. */
+static bool map_file(const char *filename, void **data, size_t *size)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+	{
+		printf("Opening file %s failed: %s\n", filename, strerror(errno));
+		return false;
+	}
+	if (fstat(fd, &st) < 0)
+	{
+		printf("Reading file %s failed: %s\n", filename, strerror(errno));
+		close(fd);
+		return false;
+	}
+	*size = st.st_size;
+	*data = NULL;
+	if (*size > 0)
+	{
+		*data = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+		if (*data == MAP_FAILED)
+		{
+			printf("Mapping file %s failed: %s\n", filename, strerror(errno));
+			close(fd);
+			return false;
+		}
+	}
+	close(fd);
+
+	return true;
+}
+
+Mesh *mesh_load(const char *filename)
+{
+	Mesh *mesh;
+	Timer *timer;
+	ObjStatus status;
+	void *data;
+	size_t size;
+	int num_chunks = 1;
+	double seconds;
+
+	mesh = calloc(1, sizeof(Mesh));
+
+	timer = timer_start("Loading mesh");
+	if (!map_file(filename, &data, &size))
+	{
+		free(timer);
+		free(mesh);
+		return NULL;
+	}
+
+	/* Binary files stay mapped for the life of the mesh */
+	if (is_mesh_file(data, size))
+	{
+		if (!mesh_map_file(mesh, data, size, filename))
+		{
+			munmap(data, size);
+			free(timer);
+			free(mesh);
+			return NULL;
+		}
+		timer_stop(timer);
+		printf("Mapped %s: %d triangles, %d kd-tree nodes in %.3f msec\n",
+				filename, mesh->num_triangles, mesh->num_kd_nodes,
+				timer_diff(timer) * 1000);
+		free(timer);
+		return mesh;
+	}
+
+	if (data != NULL)
+		posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+	status = obj_parse(data, size, mesh, filename, &num_chunks);
+	if (data != NULL)
+		munmap(data, size);
+	if (status == OBJ_UNSUPPORTED)
+	{
+		printf("Falling back to the generic OBJ reader for %s\n", filename);
+		if (obj_load_generic(filename, mesh))
+			status = OBJ_OK;
+		else
+			status = OBJ_ERROR;
+	}
+	timer_stop(timer);
+	seconds = timer_diff(timer);
+	free(timer);
+
+	if (status != OBJ_OK)
+	{
+		free(mesh);
+		return NULL;
+	}
+
+	printf("Parsed %s: %d triangles, %.2f MB", filename, mesh->num_triangles,
+			size/1e6);
+	if (seconds > 0)
+		printf(" at %.1f MB/s", size/1e6/seconds);
+	if (num_chunks > 1)
+		printf(" in %d chunks", num_chunks);
+	printf("\n");
+
+	return mesh;
+}
+
+/********************
+ * kd-tree building *
+ ********************/
+
+static KdNode *kd_node_new(Arena *arena)
+{
+	KdNode *node;
+
+	node = arena_alloc(arena, sizeof(KdNode));
+	node->leaf = false;
+	node->axis = -1;
+	node->location = HUGE_VAL;
+	node->left = node->right = NULL;
+	node->num_triangles = 0;
+	node->triangle = NULL;
+
+	return node;
+}
+
+/* Clip the triangle with the given corners and bounds against each plane of
+ * the box that it crosses, and shrink the bounds to what is left. Returns
+ * false if nothing is. */
+static bool clip_triangle(const Vec3 corner[3], const float box_lo[3],
+		const float box_hi[3], float lo[3], float hi[3])
+{
+	double poly[9][3], clipped[9][3]; /* Each plane adds at most a corner */
+	int n = 3;
+
+	for (int j = 0; j < 3; j++)
+	{
+		poly[j][0] = corner[j].x;
+		poly[j][1] = corner[j].y;
+		poly[j][2] = corner[j].z;
+	}
+
+	for (int plane = 0; plane < 6 && n > 0; plane++)
+	{
+		const int axis = plane / 2;
+		const double limit = plane % 2 ? box_hi[axis] : box_lo[axis];
+		const double side = plane % 2 ? -1 : 1;
+		int m = 0;
+
+		/* Clipping never makes the triangle any larger, so it can only
+		 * cross the planes that its corners do */
+		if (plane % 2 ? hi[axis] <= box_hi[axis] : lo[axis] >= box_lo[axis])
+			continue;
+
+		for (int i = 0; i < n; i++)
+		{
+			const double *a = poly[i], *b = poly[(i + 1) % n];
+			const double da = side * (a[axis] - limit);
+			const double db = side * (b[axis] - limit);
+
+			if (da >= 0)
+				memcpy(clipped[m++], a, sizeof(poly[0]));
+			if ((da >= 0) != (db >= 0))
+			{
+				const double t = da / (da - db);
+
+				for (int k = 0; k < 3; k++)
+					clipped[m][k] = a[k] + t * (b[k] - a[k]);
+				clipped[m++][axis] = limit;
+			}
+		}
+		memcpy(poly, clipped, m * sizeof(poly[0]));
+		n = m;
+	}
+	if (n == 0)
+		return false;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		double poly_lo = poly[0][axis], poly_hi = poly[0][axis];
+
+		for (int i = 1; i < n; i++)
+		{
+			poly_lo = MIN(poly_lo, poly[i][axis]);
+			poly_hi = MAX(poly_hi, poly[i][axis]);
+		}
+		lo[axis] = MAX(poly_lo, box_lo[axis]);
+		hi[axis] = MIN(poly_hi, box_hi[axis]);
+	}
+
+	return true;
+}
+
+/* The bounds of the part of a triangle that lies inside box, or false if
+ * none of it does. Most triangles lie inside the box and need no clipping. */
+static bool triangle_clip_bounds(const Mesh *mesh, int triangle, BBox box,
+		float lo[3], float hi[3])
+{
+	const float box_lo[3] = {box.xmin, box.ymin, box.zmin};
+	const float box_hi[3] = {box.xmax, box.ymax, box.zmax};
+	Vec3 corner[3];
+
+	for (int j = 0; j < 3; j++)
+		corner[j] = mesh->vertex[MESH_VERTEX_INDEX(mesh, triangle, j)];
+	lo[0] = MIN(MIN(corner[0].x, corner[1].x), corner[2].x);
+	lo[1] = MIN(MIN(corner[0].y, corner[1].y), corner[2].y);
+	lo[2] = MIN(MIN(corner[0].z, corner[1].z), corner[2].z);
+	hi[0] = MAX(MAX(corner[0].x, corner[1].x), corner[2].x);
+	hi[1] = MAX(MAX(corner[0].y, corner[1].y), corner[2].y);
+	hi[2] = MAX(MAX(corner[0].z, corner[1].z), corner[2].z);
+	if (lo[0] >= box_lo[0] && lo[1] >= box_lo[1] && lo[2] >= box_lo[2] &&
+			hi[0] <= box_hi[0] && hi[1] <= box_hi[1] && hi[2] <= box_hi[2])
+		return true;
+
+	return clip_triangle(corner, box_lo, box_hi, lo, hi);
+}
+
+/* Which of the children of a node, split at location, a triangle of the
+ * node goes to. Only a triangle that straddles the plane needs clipping:
+ * the part of it inside the node is convex, so it really does reach into
+ * both children if its bounds do. */
+static void triangle_sides(const Mesh *mesh, int triangle, BBox bbox,
+		enum AXIS axis, float location, bool *left, bool *right)
+{
+	float lo[3], hi[3];
+
+	lo[axis] = HUGE_VAL;
+	hi[axis] = -HUGE_VAL;
+	for (int j = 0; j < 3; j++)
+	{
+		Vec3 v = mesh->vertex[MESH_VERTEX_INDEX(mesh, triangle, j)];
+		float x = axis == X_AXIS ? v.x : (axis == Y_AXIS ? v.y : v.z);
+
+		lo[axis] = MIN(lo[axis], x);
+		hi[axis] = MAX(hi[axis], x);
+	}
+	if ((lo[axis] <= location) != (hi[axis] <= location) &&
+			!triangle_clip_bounds(mesh, triangle, bbox, lo, hi))
+	{
+		*left = *right = false;
+		return;
+	}
+	*left = lo[axis] <= location;
+	*right = hi[axis] > location;
+}
+
+/* The left child takes over the node's triangle list, which it never
+ * outgrows, so only the right one needs a new one */
+static void split_kd_tree(const Mesh *mesh, Arena *arena, KdNode *tree,
+		BBox bbox, enum AXIS axis, float location)
+{
+	int lefti, righti;
+
+	tree->location = location;
+	tree->left = kd_node_new(arena);
+	tree->right = kd_node_new(arena);
+	for (int i = 0; i < tree->num_triangles; i++)
+	{
+		bool left, right;
+
+		triangle_sides(mesh, tree->triangle[i], bbox, axis, location,
+				&left, &right);
+		if (left)
+			tree->left->num_triangles++;
+		if (right)
+			tree->right->num_triangles++;
+	}
+
+	tree->left->triangle = tree->triangle;
+	tree->right->triangle = arena_alloc(arena,
+			tree->right->num_triangles * sizeof(int));
+
+	/* lefti never passes i, so the left list can overwrite the node's */
+	lefti = righti = 0;
+	for (int i = 0; i < tree->num_triangles; i++)
+	{
+		const int triangle = tree->triangle[i];
+		bool left, right;
+
+		triangle_sides(mesh, triangle, bbox, axis, location, &left, &right);
+		if (left)
+		{
+			tree->left->triangle[lefti] = triangle;
+			lefti++;
+		}
+		if (right)
+		{
+			tree->right->triangle[righti] = triangle;
+			righti++;
+		}
+	}
+	assert(tree->left->num_triangles == lefti);
+	assert(tree->right->num_triangles == righti);
+	tree->triangle = NULL;
+	tree->num_triangles = 0;
+	tree->leaf = false;
+}
+
+const KdParams kd_default_params = {1.0, 0.25, 0.1, 0};
+
+enum { KD_BINS = 32 };
+
+/* Subtrees with fewer triangles than this aren't worth a thread of their own */
+enum { KD_PARALLEL_THRESHOLD = 4096 };
+
+/* The number of threads that may still be started to build kd-trees, on top
+ * of the ones already running. Shared by all meshes being built. */
+static int kd_spare_threads;
+static pthread_mutex_t kd_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t kd_thread_once = PTHREAD_ONCE_INIT;
+
+static void kd_threads_init(void)
+{
+	kd_spare_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+}
+
+static bool kd_claim_thread(void)
+{
+	bool ok;
+
+	pthread_mutex_lock(&kd_thread_lock);
+	ok = kd_spare_threads > 0;
+	if (ok)
+		kd_spare_threads--;
+	pthread_mutex_unlock(&kd_thread_lock);
+
+	return ok;
+}
+
+static void kd_release_thread(void)
+{
+	pthread_mutex_lock(&kd_thread_lock);
+	kd_spare_threads++;
+	pthread_mutex_unlock(&kd_thread_lock);
+}
+
+typedef struct KdBuildTask {
+	const Mesh *mesh;
+	const KdParams *params;
+	Arena arena; /* Merged into the parent's one when done */
+	KdNode *tree;
+	int depth;
+	BBox bbox;
+	pthread_t thread;
+} KdBuildTask;
+
+/* Find the cheapest split plane according to the surface area heuristic.
+ * Rather than trying every vertex, the triangles' extents are binned along
+ * each axis and all bin boundaries are evaluated in a single sweep, which
+ * keeps every node linear in its number of triangles. The extents are those
+ * of the part of each triangle inside the node, so a long triangle that only
+ * cuts across a corner of the node doesn't count along all of it. */
+static bool find_split(const Mesh *mesh, const KdParams *params,
+		const KdNode *tree, BBox bbox, enum AXIS *best_axis,
+		float *best_location)
+{
+	const float box_lo[3] = {bbox.xmin, bbox.ymin, bbox.zmin};
+	const float box_hi[3] = {bbox.xmax, bbox.ymax, bbox.zmax};
+	int start_bin[3][KD_BINS] = {{0}}, end_bin[3][KD_BINS] = {{0}};
+	double area = bbox_surface_area(bbox);
+	float best_cost, leaf_cost;
+	int num_triangles = 0;
+	bool found = false;
+
+	/* Only read when a split is found, but the compiler can't tell */
+	*best_axis = X_AXIS;
+	*best_location = 0;
+	if (area <= 0)
+		return false;
+
+	for (int i = 0; i < tree->num_triangles; i++)
+	{
+		float lo[3], hi[3];
+
+		if (!triangle_clip_bounds(mesh, tree->triangle[i], bbox, lo, hi))
+			continue;
+		num_triangles++;
+		for (int axis = X_AXIS; axis <= Z_AXIS; axis++)
+		{
+			const float extent = box_hi[axis] - box_lo[axis];
+			int kmin, kmax;
+
+			if (extent <= 0)
+				continue;
+			kmin = (lo[axis] - box_lo[axis]) / extent * KD_BINS;
+			kmax = (hi[axis] - box_lo[axis]) / extent * KD_BINS;
+			start_bin[axis][CLAMP(kmin, 0, KD_BINS - 1)]++;
+			end_bin[axis][CLAMP(kmax, 0, KD_BINS - 1)]++;
+		}
+	}
+
+	/* A split has to beat leaving the node as a leaf */
+	leaf_cost = best_cost = params->intersect_cost * num_triangles;
+
+	for (int axis = X_AXIS; axis <= Z_AXIS; axis++)
+	{
+		const float extent = box_hi[axis] - box_lo[axis];
+		int n_left, n_right;
+
+		if (extent <= 0)
+			continue;
+
+		/* The plane between bin k - 1 and bin k has every triangle that
+		 * starts below bin k on its left, and every triangle that doesn't
+		 * end below bin k on its right. */
+		n_left = 0;
+		n_right = num_triangles;
+		for (int k = 1; k < KD_BINS; k++)
+		{
+			BBox left_box, right_box;
+			float location, cost;
+
+			n_left += start_bin[axis][k - 1];
+			n_right -= end_bin[axis][k - 1];
+
+			location = box_lo[axis] + extent * k / KD_BINS;
+			bbox_split(bbox, axis, location, &left_box, &right_box);
+			cost = params->intersect_cost *
+					(n_left * bbox_surface_area(left_box) +
+					n_right * bbox_surface_area(right_box)) / area;
+			if (n_left == 0 || n_right == 0)
+				cost *= 1 - params->empty_bonus;
+			cost += params->traversal_cost;
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				*best_axis = axis;
+				*best_location = location;
+				found = true;
+			}
+		}
+	}
+
+	return found && best_cost < leaf_cost;
+}
+
+static void *build_kd_subtree_task(void *data);
+
+/* Whether a node is worth splitting, and if so where. There's no fixed
+ * limit on the number of triangles in a leaf: a node becomes one when no
+ * split is estimated to be cheaper, or at the maximum depth. */
+static bool kd_node_split(const Mesh *mesh, const KdParams *params,
+		const KdNode *tree, int depth, BBox bbox, enum AXIS *axis,
+		float *location)
+{
+	return tree->num_triangles > 0 && depth < params->max_depth &&
+			find_split(mesh, params, tree, bbox, axis, location);
+}
+
+/* The parameters with the maximum depth worked out for the mesh */
+static KdParams kd_mesh_params(const Mesh *mesh, const KdParams *params)
+{
+	KdParams p = *params;
+
+	if (p.max_depth <= 0)
+		p.max_depth = lrint(8 + 1.3 * log2(MAX(mesh->num_triangles, 1)));
+	p.max_depth = MIN(p.max_depth, KD_MAX_DEPTH);
+
+	return p;
+}
+
+static void build_kd_subtree(const Mesh *mesh, const KdParams *params,
+		Arena *arena, KdNode *tree, int depth, BBox bbox)
+{
+	enum AXIS axis;
+	float location;
+	BBox left_box, right_box;
+
+	if (!kd_node_split(mesh, params, tree, depth, bbox, &axis, &location))
+	{
+		tree->leaf = true;
+		tree->left = tree->right = NULL;
+		return;
+	}
+	tree->axis = axis;
+
+	/* Now, split the tree in twain at this location */
+	split_kd_tree(mesh, arena, tree, bbox, axis, location);
+	bbox_split(bbox, axis, location, &left_box, &right_box);
+
+	/* Large subtrees are built concurrently: the left one on a new thread,
+	 * the right one on this one. The split has handed the node's triangles
+	 * to its children. */
+	if (tree->left->num_triangles + tree->right->num_triangles >=
+			KD_PARALLEL_THRESHOLD && kd_claim_thread())
+	{
+		KdBuildTask task;
+
+		task.mesh = mesh;
+		task.params = params;
+		memset(&task.arena, 0, sizeof(Arena));
+		task.tree = tree->left;
+		task.depth = depth + 1;
+		task.bbox = left_box;
+		if (pthread_create(&task.thread, NULL, build_kd_subtree_task,
+				&task) == 0)
+		{
+			build_kd_subtree(mesh, params, arena, tree->right, depth + 1,
+					right_box);
+			pthread_join(task.thread, NULL);
+			kd_release_thread();
+			arena_merge(arena, &task.arena);
+			return;
+		}
+		kd_release_thread();
+	}
+
+	build_kd_subtree(mesh, params, arena, tree->left, depth + 1, left_box);
+	build_kd_subtree(mesh, params, arena, tree->right, depth + 1, right_box);
+}
+
+static void *build_kd_subtree_task(void *data)
+{
+	KdBuildTask *task = (KdBuildTask *) data;
+
+	build_kd_subtree(task->mesh, task->params, &task->arena, task->tree,
+			task->depth, task->bbox);
+
+	return NULL;
+}
+
+static void count_kd_nodes(const KdNode *tree, int *num_nodes,
+		int *num_indices)
+{
+	(*num_nodes)++;
+	if (tree->leaf)
+	{
+		*num_indices += (tree->num_triangles + KD_SIMD_WIDTH - 1) /
+				KD_SIMD_WIDTH * KD_SIMD_WIDTH;
+		return;
+	}
+	count_kd_nodes(tree->left, num_nodes, num_indices);
+	count_kd_nodes(tree->right, num_nodes, num_indices);
+}
+
+/* Put triangle into lane index of a kd-tree's or BVH's blocks */
+static void fill_block(const Mesh *mesh, KdTriangleBlock *blocks, int index,
+		int triangle)
+{
+	KdTriangleBlock *block = &blocks[index / KD_SIMD_WIDTH];
+	const int lane = index % KD_SIMD_WIDTH;
+	Vec3 u = mesh->vertex[MESH_VERTEX_INDEX(mesh, triangle, 0)];
+	Vec3 v = mesh->vertex[MESH_VERTEX_INDEX(mesh, triangle, 1)];
+	Vec3 w = mesh->vertex[MESH_VERTEX_INDEX(mesh, triangle, 2)];
+	Vec3 edge1 = vec3_sub(v, u), edge2 = vec3_sub(w, u);
+
+	block->vertex[0][lane] = u.x;
+	block->vertex[1][lane] = u.y;
+	block->vertex[2][lane] = u.z;
+	block->edge1[0][lane] = edge1.x;
+	block->edge1[1][lane] = edge1.y;
+	block->edge1[2][lane] = edge1.z;
+	block->edge2[0][lane] = edge2.x;
+	block->edge2[1][lane] = edge2.y;
+	block->edge2[2][lane] = edge2.z;
+}
+
+static void flatten_kd_tree(Mesh *mesh, const KdNode *tree, int index,
+		int *next_node, int *next_index)
+{
+	KdFlatNode *node = &mesh->kd_node[index];
+
+	if (tree->leaf)
+	{
+		node->u.num_triangles = tree->num_triangles;
+		node->flags = KD_LEAF | (uint32_t) *next_index << 2;
+		for (int i = 0; i < tree->num_triangles; i++)
+		{
+			fill_block(mesh, mesh->kd_block, *next_index,
+					tree->triangle[i]);
+			mesh->kd_index[(*next_index)++] = tree->triangle[i];
+		}
+		/* The padding is all zeroes, so its determinant is too */
+		while (*next_index % KD_SIMD_WIDTH != 0)
+			(*next_index)++;
+	} else
+	{
+		/* Siblings are stored next to each other */
+		int children = *next_node;
+
+		*next_node += 2;
+		node->u.split = tree->location;
+		node->flags = tree->axis | (uint32_t) children << 2;
+		flatten_kd_tree(mesh, tree->left, children, next_node, next_index);
+		flatten_kd_tree(mesh, tree->right, children + 1, next_node, next_index);
+	}
+}
+
+/* Turn the pointer based tree into the mesh's node and index arrays, in
+ * depth first order. */
+static void compile_kd_tree(Mesh *mesh, const KdNode *tree)
+{
+	int next_node = 1, next_index = 0;
+
+	mesh->num_kd_nodes = mesh->num_kd_indices = 0;
+	count_kd_nodes(tree, &mesh->num_kd_nodes, &mesh->num_kd_indices);
+	assert(mesh->num_kd_nodes < 1 << 30 && mesh->num_kd_indices < 1 << 30);
+
+	mesh->kd_node = calloc(mesh->num_kd_nodes, sizeof(KdFlatNode));
+	mesh->kd_index = calloc(MAX(mesh->num_kd_indices, 1), sizeof(uint32_t));
+	mesh->kd_block = calloc(MAX(mesh->num_kd_indices / KD_SIMD_WIDTH, 1),
+			sizeof(KdTriangleBlock));
+	flatten_kd_tree(mesh, tree, 0, &next_node, &next_index);
+	assert(next_node == mesh->num_kd_nodes);
+	assert(next_index == mesh->num_kd_indices);
+}
+
+/*****************
+ * Lazy kd-trees *
+ *****************/
+
+/* A node that has yet to be split, with what is needed to do so */
+typedef struct KdPending {
+	KdNode *tree;
+	BBox bbox;
+	int depth;
+} KdPending;
+
+/* The nodes of a lazily built tree are split by whichever thread reaches
+ * them first. The node, index and block arrays are address space reserved
+ * up front, which is only backed by memory once it's written to, so they
+ * never move while other threads are traversing them. */
+struct KdLazy {
+	pthread_mutex_t lock;
+	Mesh *mesh;
+	KdParams params;
+	Arena arena;
+	int num_pending, max_pending;
+	KdPending *pending;
+	int max_nodes, max_indices;
+	/* The indices of the leaves so far, plus those the unbuilt nodes would
+	 * take as leaves. Nodes are only split while this fits the reservation,
+	 * so any unbuilt node can always be made a leaf. */
+	int64_t committed_indices;
+};
+
+/* The reservations are generous: a full build of the mesh would have to
+ * repeat every triangle in 64 leaves to run out. A tree that would is cut
+ * short, with larger leaves. */
+enum { KD_LAZY_NODES_PER_TRIANGLE = 16, KD_LAZY_INDICES_PER_TRIANGLE = 64 };
+
+static void *kd_reserve(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static size_t kd_block_size(int num_indices)
+{
+	return (size_t) num_indices / KD_SIMD_WIDTH * sizeof(KdTriangleBlock);
+}
+
+/* The indices a leaf of n triangles takes, padding included */
+static int64_t kd_leaf_indices(int n)
+{
+	return (int64_t) (n + KD_SIMD_WIDTH - 1) / KD_SIMD_WIDTH * KD_SIMD_WIDTH;
+}
+
+/* How many triangles each child would get from a split */
+static void kd_split_counts(const Mesh *mesh, const KdNode *tree, BBox bbox,
+		enum AXIS axis, float location, int *num_left, int *num_right)
+{
+	*num_left = *num_right = 0;
+	for (int i = 0; i < tree->num_triangles; i++)
+	{
+		bool left, right;
+
+		triangle_sides(mesh, tree->triangle[i], bbox, axis, location,
+				&left, &right);
+		*num_left += left;
+		*num_right += right;
+	}
+}
+
+/* Turn node into an unbuilt one for tree, without publishing it */
+static void kd_lazy_add(struct KdLazy *lazy, KdFlatNode *node, KdNode *tree,
+		BBox bbox, int depth)
+{
+	if (lazy->num_pending == lazy->max_pending)
+	{
+		lazy->max_pending = MAX(2 * lazy->max_pending, 64);
+		lazy->pending = realloc(lazy->pending,
+				lazy->max_pending * sizeof(KdPending));
+	}
+	lazy->pending[lazy->num_pending].tree = tree;
+	lazy->pending[lazy->num_pending].bbox = bbox;
+	lazy->pending[lazy->num_pending].depth = depth;
+	node->u.pending = lazy->num_pending++;
+	node->flags = KD_UNBUILT;
+}
+
+/* Reserve the arrays and leave the root unbuilt. Returns false if there's
+ * no address space for it, and the tree should be built in full. */
+static bool kd_lazy_init(Mesh *mesh, const KdParams *params, BBox bbox)
+{
+	struct KdLazy *lazy;
+	KdNode *tree;
+	int64_t max_nodes, max_indices;
+
+	max_nodes = MIN((int64_t) KD_LAZY_NODES_PER_TRIANGLE *
+			mesh->num_triangles + 1024, 1 << 30);
+	max_indices = MIN((int64_t) KD_LAZY_INDICES_PER_TRIANGLE *
+			mesh->num_triangles + KD_SIMD_WIDTH, 1 << 30);
+	mesh->kd_node = kd_reserve(max_nodes * sizeof(KdFlatNode));
+	mesh->kd_index = kd_reserve(max_indices * sizeof(uint32_t));
+	mesh->kd_block = kd_reserve(kd_block_size(max_indices));
+	if (mesh->kd_node == NULL || mesh->kd_index == NULL ||
+			mesh->kd_block == NULL)
+	{
+		printf("Could not reserve the kd-tree of %s, building it in full\n",
+				mesh->name);
+		if (mesh->kd_node)
+			munmap(mesh->kd_node, max_nodes * sizeof(KdFlatNode));
+		if (mesh->kd_index)
+			munmap(mesh->kd_index, max_indices * sizeof(uint32_t));
+		if (mesh->kd_block)
+			munmap(mesh->kd_block, kd_block_size(max_indices));
+		mesh->kd_node = NULL;
+		mesh->kd_index = NULL;
+		mesh->kd_block = NULL;
+		return false;
+	}
+
+	lazy = calloc(1, sizeof(struct KdLazy));
+	pthread_mutex_init(&lazy->lock, NULL);
+	lazy->mesh = mesh;
+	lazy->params = *params;
+	lazy->max_nodes = max_nodes;
+	lazy->max_indices = max_indices;
+
+	tree = kd_node_new(&lazy->arena);
+	tree->num_triangles = mesh->num_triangles;
+	tree->triangle = arena_alloc(&lazy->arena,
+			tree->num_triangles * sizeof(int));
+	for (int i = 0; i < mesh->num_triangles; i++)
+		tree->triangle[i] = i;
+	kd_lazy_add(lazy, &mesh->kd_node[0], tree, bbox, 0);
+	lazy->committed_indices = kd_leaf_indices(tree->num_triangles);
+	assert(lazy->committed_indices <= lazy->max_indices);
+	mesh->num_kd_nodes = 1;
+	mesh->num_kd_indices = 0;
+	mesh->kd_lazy = lazy;
+
+	return true;
+}
+
+/* Whether an unbuilt node is to be split, and if so where. That's the full
+ * build's decision, unless the children wouldn't fit the reservations. */
+static bool kd_lazy_split(struct KdLazy *lazy, const KdPending *pending,
+		enum AXIS *axis, float *location)
+{
+	const Mesh *mesh = lazy->mesh;
+	int num_left, num_right;
+	int64_t committed;
+
+	if (mesh->num_kd_nodes + 2 > lazy->max_nodes ||
+			!kd_node_split(mesh, &lazy->params, pending->tree,
+			pending->depth, pending->bbox, axis, location))
+		return false;
+
+	kd_split_counts(mesh, pending->tree, pending->bbox, *axis, *location,
+			&num_left, &num_right);
+	committed = lazy->committed_indices -
+			kd_leaf_indices(pending->tree->num_triangles) +
+			kd_leaf_indices(num_left) + kd_leaf_indices(num_right);
+	if (committed > lazy->max_indices)
+		return false;
+	lazy->committed_indices = committed;
+
+	return true;
+}
+
+/* Split an unbuilt node, or make it a leaf, the same way the full build
+ * would have, and return it. Its children are left unbuilt. Traversals call
+ * this when they reach a node with KD_UNBUILT flags. */
+const KdFlatNode *mesh_expand_kd_node(const Mesh *mesh, const KdFlatNode *node)
+{
+	struct KdLazy *lazy = mesh->kd_lazy;
+	Mesh *rw_mesh = lazy->mesh;
+	KdFlatNode *rw_node = &rw_mesh->kd_node[node - mesh->kd_node];
+	KdPending pending;
+	enum AXIS axis;
+	float location;
+
+	pthread_mutex_lock(&lazy->lock);
+	/* Another thread may have beaten us to it */
+	if (rw_node->flags != KD_UNBUILT)
+	{
+		pthread_mutex_unlock(&lazy->lock);
+		return node;
+	}
+	pending = lazy->pending[rw_node->u.pending];
+
+	if (kd_lazy_split(lazy, &pending, &axis, &location))
+	{
+		const int children = rw_mesh->num_kd_nodes;
+		BBox left_box, right_box;
+
+		split_kd_tree(rw_mesh, &lazy->arena, pending.tree, pending.bbox,
+				axis, location);
+		bbox_split(pending.bbox, axis, location, &left_box, &right_box);
+		kd_lazy_add(lazy, &rw_mesh->kd_node[children], pending.tree->left,
+				left_box, pending.depth + 1);
+		kd_lazy_add(lazy, &rw_mesh->kd_node[children + 1],
+				pending.tree->right, right_box, pending.depth + 1);
+		rw_mesh->num_kd_nodes += 2;
+
+		rw_node->u.split = location;
+		__atomic_store_n(&rw_node->flags,
+				axis | (uint32_t) children << 2, __ATOMIC_RELEASE);
+	} else
+	{
+		const KdNode *tree = pending.tree;
+		const int offset = rw_mesh->num_kd_indices;
+
+		/* The leaf's indices were committed when its parent was split */
+		assert(offset + kd_leaf_indices(tree->num_triangles) <=
+				lazy->max_indices);
+		/* The padding was zeroed by mmap() */
+		for (int i = 0; i < tree->num_triangles; i++)
+		{
+			fill_block(mesh, rw_mesh->kd_block, offset + i,
+					tree->triangle[i]);
+			rw_mesh->kd_index[offset + i] = tree->triangle[i];
+		}
+		rw_mesh->num_kd_indices += (tree->num_triangles + KD_SIMD_WIDTH - 1) /
+				KD_SIMD_WIDTH * KD_SIMD_WIDTH;
+
+		rw_node->u.num_triangles = tree->num_triangles;
+		__atomic_store_n(&rw_node->flags,
+				KD_LEAF | (uint32_t) offset << 2, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&lazy->lock);
+
+	return node;
+}
+
+/* Split all the nodes that are left, as the tree is about to be saved */
+void mesh_finish_kd_tree(Mesh *mesh)
+{
+	struct KdLazy *lazy = mesh->kd_lazy;
+
+	if (lazy == NULL)
+		return;
+
+	/* Children come after their parents */
+	for (int i = 0; i < mesh->num_kd_nodes; i++)
+		if (mesh->kd_node[i].flags == KD_UNBUILT)
+			mesh_expand_kd_node(mesh, &mesh->kd_node[i]);
+
+	pthread_mutex_destroy(&lazy->lock);
+	arena_free(&lazy->arena);
+	free(lazy->pending);
+	free(lazy);
+	mesh->kd_lazy = NULL;
+}
+
+void mesh_build_kd_tree(Mesh *mesh, const KdParams *params)
+{
+	KdParams mesh_params;
+	KdNode *tree;
+	BBox bbox;
+
+	bbox.xmin = bbox.ymin = bbox.zmin =  HUGE_VAL;
+	bbox.xmax = bbox.ymax = bbox.zmax = -HUGE_VAL;
+
+	for (int i = 0; i < mesh->num_triangles; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			Vec3 v = mesh->vertex[MESH_VERTEX_INDEX(mesh, i, j)];
+			if (v.x < bbox.xmin)
+				bbox.xmin = v.x;
+			if (v.x > bbox.xmax)
+				bbox.xmax = v.x;
+			if (v.y < bbox.ymin)
+				bbox.ymin = v.y;
+			if (v.y > bbox.ymax)
+				bbox.ymax = v.y;
+			if (v.z < bbox.zmin)
+				bbox.zmin = v.z;
+			if (v.z > bbox.zmax)
+				bbox.zmax = v.z;
+		}
+	}
+	mesh_params = kd_mesh_params(mesh, params);
+	if (mesh->lazy_kd_tree && kd_lazy_init(mesh, &mesh_params, bbox))
+		return;
+
+	pthread_once(&kd_thread_once, kd_threads_init);
+	tree = kd_node_new(&mesh->kd_arena);
+	/* The split moves the triangles to the children */
+	tree->num_triangles = mesh->num_triangles;
+	tree->triangle = arena_alloc(&mesh->kd_arena,
+			tree->num_triangles * sizeof(int));
+	for (int i = 0; i < mesh->num_triangles; i++)
+		tree->triangle[i] = i;
+	build_kd_subtree(mesh, &mesh_params, &mesh->kd_arena, tree, 0, bbox);
+
+	compile_kd_tree(mesh, tree);
+	arena_free(&mesh->kd_arena);
+}
+
+/*************
+ * Wide BVHs *
+ *************/
+
+/* The BVH is built as a binary tree by binned SAH over the triangles'
+ * centroids, then collapsed into nodes of MESH_BVH_WIDTH children. Unlike
+ * the kd-tree, every triangle ends up in exactly one leaf. */
+enum { MESH_BVH_BINS = 16 };
+
+/* The cost of visiting a node, relative to that of testing a ray against a
+ * block of triangles, which is what a leaf costs per block */
+#define MESH_BVH_NODE_COST 1.0
+
+typedef struct MeshBvhTree {
+	BBox bbox;
+	struct MeshBvhTree *child[2]; /* NULL for a leaf */
+	int first, count; /* Of a leaf, in the builder's order */
+} MeshBvhTree;
+
+typedef struct MeshBvhBuilder {
+	Mesh *mesh;
+	Arena arena;
+	BBox *box; /* Of each triangle */
+	uint32_t *order; /* The triangles, grouped by leaf as they're built */
+	int node_capacity, index_capacity;
+} MeshBvhBuilder;
+
+typedef struct MeshBvhSplit {
+	enum AXIS axis;
+	int bin; /* Triangles in bins below this one go left */
+	float min, scale; /* Maps a centroid coordinate to its bin */
+} MeshBvhSplit;
+
+static float bbox_lo(BBox b, enum AXIS axis)
+{
+	return axis == X_AXIS ? b.xmin : (axis == Y_AXIS ? b.ymin : b.zmin);
+}
+
+static float bbox_hi(BBox b, enum AXIS axis)
+{
+	return axis == X_AXIS ? b.xmax : (axis == Y_AXIS ? b.ymax : b.zmax);
+}
+
+/* Twice the centroid, which bins just as well */
+static float bvh_centroid(const MeshBvhBuilder *b, int i, enum AXIS axis)
+{
+	BBox box = b->box[b->order[i]];
+
+	return bbox_lo(box, axis) + bbox_hi(box, axis);
+}
+
+static int bvh_bin(float min, float scale, float x)
+{
+	int k = (x - min) * scale;
+
+	return CLAMP(k, 0, MESH_BVH_BINS - 1);
+}
+
+/* The blocks a leaf of n triangles takes up */
+static int bvh_blocks(int n)
+{
+	return (n + KD_SIMD_WIDTH - 1) / KD_SIMD_WIDTH;
+}
+
+/* Find the best split of [first, last) by binned SAH. Returns false if the
+ * node is better off as a leaf. */
+static bool bvh_find_split(const MeshBvhBuilder *b, int first, int last,
+		BBox box, MeshBvhSplit *split)
+{
+	const double area = bbox_surface_area(box);
+	double best_cost = bvh_blocks(last - first) * area;
+	float cmin[3], cmax[3];
+	bool found = false;
+
+	for (int a = X_AXIS; a <= Z_AXIS; a++)
+	{
+		cmin[a] =  HUGE_VAL;
+		cmax[a] = -HUGE_VAL;
+		for (int i = first; i < last; i++)
+		{
+			cmin[a] = MIN(cmin[a], bvh_centroid(b, i, a));
+			cmax[a] = MAX(cmax[a], bvh_centroid(b, i, a));
+		}
+	}
+
+	for (int a = X_AXIS; a <= Z_AXIS; a++)
+	{
+		BBox bin_box[MESH_BVH_BINS], left_box, right_box;
+		int bin_count[MESH_BVH_BINS], left_count[MESH_BVH_BINS];
+		double left_area[MESH_BVH_BINS];
+		int right_count;
+		float scale;
+
+		if (cmax[a] - cmin[a] <= 0)
+			continue;
+		scale = MESH_BVH_BINS / (cmax[a] - cmin[a]);
+
+		for (int k = 0; k < MESH_BVH_BINS; k++)
+		{
+			bin_box[k] = bbox_empty();
+			bin_count[k] = 0;
+		}
+		for (int i = first; i < last; i++)
+		{
+			int k = bvh_bin(cmin[a], scale, bvh_centroid(b, i, a));
+
+			bin_count[k]++;
+			bin_box[k] = bbox_union(bin_box[k], b->box[b->order[i]]);
+		}
+
+		left_box = bbox_empty();
+		for (int k = 0; k < MESH_BVH_BINS - 1; k++)
+		{
+			left_box = bbox_union(left_box, bin_box[k]);
+			left_count[k] = (k > 0 ? left_count[k - 1] : 0) + bin_count[k];
+			left_area[k] = bbox_surface_area(left_box);
+		}
+		right_box = bbox_empty();
+		right_count = 0;
+		for (int k = MESH_BVH_BINS - 1; k > 0; k--)
+		{
+			double cost;
+
+			right_box = bbox_union(right_box, bin_box[k]);
+			right_count += bin_count[k];
+			if (left_count[k - 1] == 0 || right_count == 0)
+				continue;
+
+			cost = MESH_BVH_NODE_COST * area +
+					bvh_blocks(left_count[k - 1]) * left_area[k - 1] +
+					bvh_blocks(right_count) * bbox_surface_area(right_box);
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				split->axis = a;
+				split->bin = k;
+				split->min = cmin[a];
+				split->scale = scale;
+				found = true;
+			}
+		}
+	}
+
+	return found;
+}
+
+static MeshBvhTree *bvh_build_tree(MeshBvhBuilder *b, int first, int last,
+		int depth)
+{
+	MeshBvhTree *tree = arena_alloc(&b->arena, sizeof(MeshBvhTree));
+	MeshBvhSplit split;
+	int mid;
+
+	tree->bbox = bbox_empty();
+	for (int i = first; i < last; i++)
+		tree->bbox = bbox_union(tree->bbox, b->box[b->order[i]]);
+	tree->child[0] = tree->child[1] = NULL;
+	tree->first = first;
+	tree->count = last - first;
+
+	if (depth >= MESH_BVH_MAX_DEPTH || last - first <= 1 ||
+			!bvh_find_split(b, first, last, tree->bbox, &split))
+		return tree;
+
+	mid = first;
+	for (int i = first; i < last; i++)
+	{
+		if (bvh_bin(split.min, split.scale,
+				bvh_centroid(b, i, split.axis)) < split.bin)
+		{
+			uint32_t t = b->order[i];
+
+			b->order[i] = b->order[mid];
+			b->order[mid++] = t;
+		}
+	}
+	assert(mid > first && mid < last);
+
+	tree->child[0] = bvh_build_tree(b, first, mid, depth + 1);
+	tree->child[1] = bvh_build_tree(b, mid, last, depth + 1);
+
+	return tree;
+}
+
+/* Turn the binary subtree into a wide node, and the nodes below that, in
+ * depth first order. Returns its index. The children of the node are found
+ * by opening up the largest inner one until there are MESH_BVH_WIDTH. */
+static uint32_t bvh_flatten(MeshBvhBuilder *b, const MeshBvhTree *tree)
+{
+	Mesh *mesh = b->mesh;
+	const MeshBvhTree *slot[MESH_BVH_WIDTH];
+	MeshBvhNode node;
+	int n = 0, index;
+
+	if (tree->child[0] == NULL)
+	{
+		slot[n++] = tree;
+	} else
+	{
+		slot[n++] = tree->child[0];
+		slot[n++] = tree->child[1];
+	}
+	while (n < MESH_BVH_WIDTH)
+	{
+		double best_area = -1;
+		int best = -1;
+
+		for (int i = 0; i < n; i++)
+			if (slot[i]->child[0] &&
+					bbox_surface_area(slot[i]->bbox) > best_area)
+			{
+				best_area = bbox_surface_area(slot[i]->bbox);
+				best = i;
+			}
+		if (best < 0)
+			break;
+
+		slot[n++] = slot[best]->child[1];
+		slot[best] = slot[best]->child[0];
+	}
+
+	/* The children may move the array, so the node is filled in here and
+	 * copied over at the end */
+	mesh->bvh_node = grow_array(mesh->bvh_node, mesh->num_bvh_nodes,
+			&b->node_capacity, sizeof(MeshBvhNode));
+	index = mesh->num_bvh_nodes++;
+
+	for (int i = 0; i < MESH_BVH_WIDTH; i++)
+	{
+		for (int a = X_AXIS; a <= Z_AXIS; a++)
+		{
+			node.lo[a][i] =  HUGE_VAL;
+			node.hi[a][i] = -HUGE_VAL;
+		}
+		node.child[i] = node.num_triangles[i] = 0;
+	}
+	for (int i = 0; i < n; i++)
+	{
+		const MeshBvhTree *child = slot[i];
+
+		/* Only an empty mesh has an empty leaf, which stays unused */
+		if (child->count == 0)
+			continue;
+		for (int a = X_AXIS; a <= Z_AXIS; a++)
+		{
+			node.lo[a][i] = bbox_lo(child->bbox, a);
+			node.hi[a][i] = bbox_hi(child->bbox, a);
+		}
+		if (child->child[0])
+		{
+			node.child[i] = bvh_flatten(b, child);
+			continue;
+		}
+
+		node.child[i] = mesh->num_bvh_indices;
+		node.num_triangles[i] = child->count;
+		for (int j = 0; j < bvh_blocks(child->count) * KD_SIMD_WIDTH; j++)
+		{
+			mesh->bvh_index = grow_array(mesh->bvh_index,
+					mesh->num_bvh_indices, &b->index_capacity,
+					sizeof(uint32_t));
+			mesh->bvh_index[mesh->num_bvh_indices++] = j < child->count ?
+					b->order[child->first + j] : 0;
+		}
+	}
+	mesh->bvh_node[index] = node;
+
+	return index;
+}
+
+void mesh_build_bvh(Mesh *mesh)
+{
+	MeshBvhBuilder b;
+	MeshBvhTree *tree;
+
+	memset(&b, 0, sizeof(b));
+	b.mesh = mesh;
+	b.box = malloc(MAX(mesh->num_triangles, 1) * sizeof(BBox));
+	b.order = malloc(MAX(mesh->num_triangles, 1) * sizeof(uint32_t));
+	for (int i = 0; i < mesh->num_triangles; i++)
+	{
+		b.box[i] = bbox_empty();
+		for (int j = 0; j < 3; j++)
+		{
+			Vec3 v = mesh->vertex[MESH_VERTEX_INDEX(mesh, i, j)];
+
+			b.box[i].xmin = MIN(b.box[i].xmin, v.x);
+			b.box[i].ymin = MIN(b.box[i].ymin, v.y);
+			b.box[i].zmin = MIN(b.box[i].zmin, v.z);
+			b.box[i].xmax = MAX(b.box[i].xmax, v.x);
+			b.box[i].ymax = MAX(b.box[i].ymax, v.y);
+			b.box[i].zmax = MAX(b.box[i].zmax, v.z);
+		}
+		b.order[i] = i;
+	}
+	tree = bvh_build_tree(&b, 0, mesh->num_triangles, 0);
+
+	mesh->num_bvh_nodes = mesh->num_bvh_indices = 0;
+	mesh->bvh_node = NULL;
+	mesh->bvh_index = NULL;
+	bvh_flatten(&b, tree);
+	mesh->bvh_node = realloc(mesh->bvh_node,
+			mesh->num_bvh_nodes * sizeof(MeshBvhNode));
+	mesh->bvh_index = realloc(mesh->bvh_index,
+			MAX(mesh->num_bvh_indices, 1) * sizeof(uint32_t));
+
+	/* The padding is all zeroes, as in the kd-tree */
+	mesh->bvh_block = calloc(MAX(mesh->num_bvh_indices / KD_SIMD_WIDTH, 1),
+			sizeof(KdTriangleBlock));
+	for (int i = 0; i < mesh->num_bvh_nodes; i++)
+	{
+		const MeshBvhNode *node = &mesh->bvh_node[i];
+
+		for (int k = 0; k < MESH_BVH_WIDTH; k++)
+			for (uint32_t j = 0; j < node->num_triangles[k]; j++)
+				fill_block(mesh, mesh->bvh_block, node->child[k] + j,
+						mesh->bvh_index[node->child[k] + j]);
+	}
+
+	arena_free(&b.arena);
+	free(b.box);
+	free(b.order);
+}
+
+typedef struct MeshTreeJob {
+	Mesh **mesh;
+	Timer **timer;
+	const KdParams *params;
+	int num_meshes;
+	int next_mesh;
+	pthread_mutex_t lock;
+} MeshTreeJob;
+
+static void *build_trees_worker(void *data)
+{
+	MeshTreeJob *job = (MeshTreeJob *) data;
+
+	for (;;)
+	{
+		int i;
+
+		pthread_mutex_lock(&job->lock);
+		i = job->next_mesh++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->num_meshes)
+			break;
+
+		job->timer[i] = timer_start(job->mesh[i]->name);
+		if (job->mesh[i]->accel == MESH_BVH)
+			mesh_build_bvh(job->mesh[i]);
+		else
+			mesh_build_kd_tree(job->mesh[i], job->params);
+		timer_stop(job->timer[i]);
+	}
+
+	return NULL;
+}
+
+/* Build the kd-trees or BVHs of n meshes at once, timing each of them. Meshes are
+ * handed out to as many threads as there are spare cores, and whatever
+ * cores are left over help out with the large subtrees. */
+void mesh_build_trees(Mesh **mesh, Timer **timer, int n,
+		const KdParams *params)
+{
+	MeshTreeJob job;
+	pthread_t *thread;
+	int num_threads = 0;
+
+	pthread_once(&kd_thread_once, kd_threads_init);
+
+	job.mesh = mesh;
+	job.timer = timer;
+	job.params = params;
+	job.num_meshes = n;
+	job.next_mesh = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	thread = calloc(MAX(n - 1, 1), sizeof(pthread_t));
+	while (num_threads < n - 1 && kd_claim_thread())
+	{
+		if (pthread_create(&thread[num_threads], NULL, build_trees_worker,
+				&job) != 0)
+		{
+			kd_release_thread();
+			break;
+		}
+		num_threads++;
+	}
+
+	/* The calling thread works along */
+	build_trees_worker(&job);
+	for (int i = 0; i < num_threads; i++)
+	{
+		pthread_join(thread[i], NULL);
+		kd_release_thread();
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	free(thread);
 }
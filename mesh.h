@@ -2,8 +2,11 @@
 #define CG_MESH_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include "arena.h"
 #include "cgmath.h"
 #include "bbox.h"
+#include "timer.h"
 
 typedef struct Triangle {
 	int vertex_index[3];
@@ -31,10 +34,41 @@ typedef struct Mesh {
 
 	int num_triangles;
 	Triangle *triangle;
+	/* When mesh_optimise() finds that every corner can use the same index
+	 * for its vertex, normal and texcoord, the triangles keep just that one
+	 * index per corner, in one of these, and triangle is NULL */
+	uint16_t *index16;
+	uint32_t *index32;
 
-	struct KdNode *kd_tree;
+	int num_kd_nodes;
+	struct KdFlatNode *kd_node; /* The root comes first */
+	int num_kd_indices;
+	uint32_t *kd_index; /* Triangle indices of all leaves, back to back */
+	struct KdTriangleBlock *kd_block; /* The same triangles, as SIMD blocks */
+	/* The nodes and triangle lists of the pointer based kd-tree while it is
+	 * being built */
+	Arena kd_arena;
+	/* Split kd-tree nodes only when a ray first reaches them, rather than
+	 * building the whole tree before rendering */
+	bool lazy_kd_tree;
+	struct KdLazy *kd_lazy; /* While there may be nodes left to split */
+
+	/* Which structure rays are traced through. Only that one needs to be
+	 * built, but both may be. */
+	enum MeshAccel { MESH_KD_TREE, MESH_BVH } accel;
+	int num_bvh_nodes;
+	struct MeshBvhNode *bvh_node; /* The root comes first */
+	int num_bvh_indices;
+	uint32_t *bvh_index; /* Like kd_index, for the leaves of the BVH */
+	struct KdTriangleBlock *bvh_block;
+
+	/* For a binary mesh file, the read only mapping that all of the above
+	 * point into */
+	const void *file;
+	size_t file_size;
 } Mesh;
 
+/* A node of the kd-tree while it is being built */
 typedef struct KdNode {
 	bool leaf;
 	enum AXIS axis;
@@ -42,10 +76,105 @@ typedef struct KdNode {
 	struct KdNode *right;
 	float location;
 	int num_triangles;
-	Triangle *triangle;
+	int *triangle; /* Indices into the mesh's triangles */
 } KdNode;
 
+/* The compact form of a node that is used for rendering. The two low bits of
+ * flags hold the split axis, or KD_LEAF. The remaining bits hold the index
+ * of the left child, with the right one right after it, or for a leaf the
+ * offset of its first triangle in kd_index. */
+enum { KD_LEAF = 3 };
+
+typedef struct KdFlatNode {
+	union {
+		float split;
+		uint32_t num_triangles;
+		uint32_t pending; /* Of an unbuilt node, see mesh_expand_kd_node() */
+	} u;
+	uint32_t flags;
+} KdFlatNode;
+
+/* The flags of a node of a lazily built tree that hasn't been split yet. A
+ * real leaf can't have these, as its offset is a multiple of KD_SIMD_WIDTH. */
+#define KD_UNBUILT 0xffffffffu
+
+/* The vertex, normal and texcoord indices of corner j of triangle i, whichever
+ * way the mesh stores them */
+#define MESH_INDEX(mesh, i, j) ((mesh)->index16 ? \
+		(int) (mesh)->index16[3*(i) + (j)] : (int) (mesh)->index32[3*(i) + (j)])
+#define MESH_VERTEX_INDEX(mesh, i, j) ((mesh)->triangle ? \
+		(mesh)->triangle[i].vertex_index[j] : MESH_INDEX(mesh, i, j))
+#define MESH_NORMAL_INDEX(mesh, i, j) ((mesh)->triangle ? \
+		(mesh)->triangle[i].normal_index[j] : MESH_INDEX(mesh, i, j))
+#define MESH_TEXCOORD_INDEX(mesh, i, j) ((mesh)->triangle ? \
+		(mesh)->triangle[i].texcoord_index[j] : MESH_INDEX(mesh, i, j))
+
+/* A lazily built tree is written to while it's being traversed. The flags
+ * of a node are written last, so they're read with acquire semantics, which
+ * costs nothing on x86. */
+#define KD_NODE_FLAGS(n) __atomic_load_n(&(n)->flags, __ATOMIC_ACQUIRE)
+#define KD_NODE_AXIS(n) (KD_NODE_FLAGS(n) & 3)
+#define KD_NODE_OFFSET(n) (KD_NODE_FLAGS(n) >> 2)
+
+/* The triangles of the leaves are also stored as structures of arrays, so the
+ * intersection test can handle one block with a single SIMD instruction per
+ * operation. Every leaf is padded to a whole number of blocks with degenerate
+ * triangles, which keeps the block of kd_index[i] at kd_block[i/KD_SIMD_WIDTH].
+ * The padding entries of kd_index are 0, but they never hit. */
+#if defined(__AVX__)
+#define KD_SIMD_WIDTH 8
+#else
+#define KD_SIMD_WIDTH 4
+#endif
+
+typedef struct KdTriangleBlock {
+	float vertex[3][KD_SIMD_WIDTH]; /* The first vertex, x, y and z */
+	float edge1[3][KD_SIMD_WIDTH]; /* From the first to the second vertex */
+	float edge2[3][KD_SIMD_WIDTH]; /* From the first to the third vertex */
+} KdTriangleBlock;
+
+/* How the kd-tree builder decides whether and where to split a node, by the
+ * surface area heuristic. The costs are relative to each other. */
+typedef struct KdParams {
+	float traversal_cost; /* Of descending into a node */
+	float intersect_cost; /* Of intersecting a triangle */
+	/* The fraction of the cost taken off a split with an empty side, which
+	 * favours cutting away empty space */
+	float empty_bonus;
+	int max_depth; /* 0 for 8 + 1.3 log2(n) */
+} KdParams;
+
+/* The most the depth can be, whatever the parameters say */
+enum { KD_MAX_DEPTH = 64 };
+
+extern const KdParams kd_default_params;
+
+/* A node of the wide BVH, with up to MESH_BVH_WIDTH children. Their boxes
+ * are stored as structures of arrays, so a ray is tested against all of them
+ * at once. Unused slots have an empty box, which no ray hits. A leaf child's
+ * triangles are num_triangles[i] entries of bvh_index from child[i] on,
+ * padded to whole blocks like those of the kd-tree; an inner child has no
+ * triangles and child[i] is its index in bvh_node. */
+#define MESH_BVH_WIDTH KD_SIMD_WIDTH
+
+typedef struct MeshBvhNode {
+	float lo[3][MESH_BVH_WIDTH];
+	float hi[3][MESH_BVH_WIDTH];
+	uint32_t child[MESH_BVH_WIDTH];
+	uint32_t num_triangles[MESH_BVH_WIDTH];
+} MeshBvhNode;
+
+/* Deeper nodes are made leaves, however many triangles they have */
+enum { MESH_BVH_MAX_DEPTH = 64 };
+
 Mesh *mesh_load(const char *filename);
-void mesh_build_kd_tree(Mesh *mesh);
+bool mesh_save(const Mesh *mesh, const char *filename);
+void mesh_optimise(Mesh *mesh);
+void mesh_build_kd_tree(Mesh *mesh, const KdParams *params);
+void mesh_build_bvh(Mesh *mesh);
+void mesh_build_trees(Mesh **mesh, Timer **timer, int n,
+		const KdParams *params);
+const KdFlatNode *mesh_expand_kd_node(const Mesh *mesh, const KdFlatNode *node);
+void mesh_finish_kd_tree(Mesh *mesh);
 
 #endif
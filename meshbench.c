@@ -0,0 +1,185 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mesh.h"
+#include "ray.h"
+#include "rng.h"
+#include "timer.h"
+
+/* Compares the kd-tree and the BVH of each OBJ file given: how long they
+ * take to build, how much memory they take up and how many rays a second
+ * they trace. The rays start on a sphere around the mesh and aim at random
+ * points in its bounding box, so most of them hit it. Like the raytracer
+ * does, they are clipped to that box before they reach either tree. */
+enum { NUM_RAYS = 1 << 20 };
+
+/* The stretch of the ray inside the box, made a little larger so that hits
+ * right on its sides aren't lost */
+static void bench_clip(Ray *ray, BBox box)
+{
+	const double lo[3] = {box.xmin, box.ymin, box.zmin};
+	const double hi[3] = {box.xmax, box.ymax, box.zmax};
+	const double o[3] = {ray->origin.x, ray->origin.y, ray->origin.z};
+	const double d[3] = {ray->direction.x, ray->direction.y,
+			ray->direction.z};
+	double near = 0, far = HUGE_VAL;
+
+	for (int k = 0; k < 3; k++)
+	{
+		double t0 = (lo[k] - o[k]) / d[k], t1 = (hi[k] - o[k]) / d[k];
+
+		near = MAX(near, MIN(t0, t1));
+		far = MIN(far, MAX(t0, t1));
+	}
+	ray->near = MAX(0, near - 1e-4 * (far - near));
+	ray->far = far + 1e-4 * (far - near);
+}
+
+static void bench_rays(const Mesh *mesh, Ray *ray)
+{
+	BBox box = bbox_empty();
+	Vec3 centre, size;
+	double radius;
+
+	for (int i = 0; i < mesh->num_vertices; i++)
+	{
+		box.xmin = MIN(box.xmin, mesh->vertex[i].x);
+		box.ymin = MIN(box.ymin, mesh->vertex[i].y);
+		box.zmin = MIN(box.zmin, mesh->vertex[i].z);
+		box.xmax = MAX(box.xmax, mesh->vertex[i].x);
+		box.ymax = MAX(box.ymax, mesh->vertex[i].y);
+		box.zmax = MAX(box.zmax, mesh->vertex[i].z);
+	}
+	size = vec3_sub((Vec3) {box.xmax, box.ymax, box.zmax},
+			(Vec3) {box.xmin, box.ymin, box.zmin});
+	centre = vec3_add((Vec3) {box.xmin, box.ymin, box.zmin},
+			vec3_scale(0.5, size));
+	radius = MAX(vec3_length(size), 1e-3);
+
+	for (int i = 0; i < NUM_RAYS; i++)
+	{
+		Rng rng = rng_pixel(i % 1024, i / 1024, 0);
+		double z = 2*rng_double(&rng) - 1, phi = M_TWO_PI*rng_double(&rng);
+		double r = sqrt(1 - z*z);
+		Vec3 target;
+
+		ray[i].origin = vec3_add(centre, vec3_scale(radius,
+				(Vec3) {r*cos(phi), r*sin(phi), z}));
+		target.x = box.xmin + size.x*rng_double(&rng);
+		target.y = box.ymin + size.y*rng_double(&rng);
+		target.z = box.zmin + size.z*rng_double(&rng);
+		ray[i].direction = vec3_normalize(vec3_sub(target, ray[i].origin));
+		bench_clip(&ray[i], box);
+	}
+}
+
+/* Traces all rays, keeping their hits. Returns the millions of rays a
+ * second. */
+static double bench_trace(const Mesh *mesh, const Ray *ray, Hit *hit,
+		bool *did_hit)
+{
+	Timer *timer = timer_start("Tracing");
+	double seconds;
+
+	for (int i = 0; i < NUM_RAYS; i++)
+		did_hit[i] = ray_mesh_intersect(ray[i], mesh, &hit[i]);
+	timer_stop(timer);
+	seconds = timer_diff(timer);
+	free(timer);
+
+	return NUM_RAYS / MAX(seconds, 1e-9) / 1e6;
+}
+
+static double bench_build(Mesh *mesh)
+{
+	Timer *timer = timer_start("Building");
+	double seconds;
+
+	if (mesh->accel == MESH_BVH)
+		mesh_build_bvh(mesh);
+	else
+		mesh_build_kd_tree(mesh, &kd_default_params);
+	timer_stop(timer);
+	seconds = timer_diff(timer);
+	free(timer);
+
+	return seconds;
+}
+
+int main(int argc, char **argv)
+{
+	Ray *ray;
+	Hit *kd_hit, *bvh_hit;
+	bool *kd_did_hit, *bvh_did_hit;
+
+	if (argc < 2)
+	{
+		printf("Usage: %s mesh.obj...\n", argv[0]);
+		return 1;
+	}
+
+	ray = malloc(NUM_RAYS * sizeof(Ray));
+	kd_hit = malloc(NUM_RAYS * sizeof(Hit));
+	bvh_hit = malloc(NUM_RAYS * sizeof(Hit));
+	kd_did_hit = malloc(NUM_RAYS * sizeof(bool));
+	bvh_did_hit = malloc(NUM_RAYS * sizeof(bool));
+
+	printf("%-16s %9s %-8s %9s %9s %9s %9s\n", "mesh", "triangles",
+			"tree", "nodes", "memory kB", "build s", "Mrays/s");
+	for (int i = 1; i < argc; i++)
+	{
+		Mesh *mesh = mesh_load(argv[i]);
+		double kd_build, bvh_build, kd_speed, bvh_speed;
+		size_t kd_size, bvh_size;
+		int hits = 0, mismatches = 0;
+
+		if (mesh == NULL)
+			return 1;
+		bench_rays(mesh, ray);
+
+		mesh->accel = MESH_KD_TREE;
+		kd_build = mesh->kd_node ? 0 : bench_build(mesh);
+		kd_speed = bench_trace(mesh, ray, kd_hit, kd_did_hit);
+		mesh->accel = MESH_BVH;
+		bvh_build = bench_build(mesh);
+		bvh_speed = bench_trace(mesh, ray, bvh_hit, bvh_did_hit);
+
+		kd_size = mesh->num_kd_nodes * sizeof(KdFlatNode) +
+				mesh->num_kd_indices * sizeof(uint32_t) +
+				mesh->num_kd_indices / KD_SIMD_WIDTH * sizeof(KdTriangleBlock);
+		bvh_size = mesh->num_bvh_nodes * sizeof(MeshBvhNode) +
+				mesh->num_bvh_indices * sizeof(uint32_t) +
+				mesh->num_bvh_indices / KD_SIMD_WIDTH *
+				sizeof(KdTriangleBlock);
+
+		/* Both should find the same hits, give or take rounding */
+		for (int j = 0; j < NUM_RAYS; j++)
+		{
+			hits += kd_did_hit[j];
+			if (kd_did_hit[j] != bvh_did_hit[j] || (kd_did_hit[j] &&
+					fabs(kd_hit[j].t - bvh_hit[j].t) >
+					1e-4 * MAX(1, kd_hit[j].t)))
+				mismatches++;
+		}
+
+		printf("%-16s %9d %-8s %9d %9zu %9.3f %9.2f\n", argv[i],
+				mesh->num_triangles, "kd-tree", mesh->num_kd_nodes,
+				kd_size / 1024, kd_build, kd_speed);
+		printf("%-16s %9s %-8s %9d %9zu %9.3f %9.2f\n", "", "", "BVH",
+				mesh->num_bvh_nodes, bvh_size / 1024, bvh_build, bvh_speed);
+		printf("%-16s %9s %d of %d rays hit", "", "", hits, NUM_RAYS);
+		if (mismatches > 0)
+			printf(", %d differently", mismatches);
+		printf("\n");
+	}
+
+	free(ray);
+	free(kd_hit);
+	free(bvh_hit);
+	free(kd_did_hit);
+	free(bvh_did_hit);
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mesh.h"
+#include "timer.h"
+
+/* Converts an OBJ file to a binary mesh file, with the kd-tree built, which
+ * the raytracer can then map instead of parsing it and building the tree
+ * for every run. */
+int main(int argc, char **argv)
+{
+	Mesh *mesh;
+	Timer *timer;
+	bool optimise = argc == 4 && strcmp(argv[1], "--optimise") == 0;
+
+	if (argc != 3 && !optimise)
+	{
+		printf("Usage: %s [--optimise] input.obj output.mesh\n", argv[0]);
+		return 1;
+	}
+	argv += optimise;
+
+	mesh = mesh_load(argv[1]);
+	if (mesh == NULL)
+		return 1;
+	if (optimise)
+		mesh_optimise(mesh);
+
+	if (mesh->kd_node == NULL)
+	{
+		timer = timer_start("Building kd-tree");
+		mesh_build_kd_tree(mesh, &kd_default_params);
+		timer_stop(timer);
+		timer_diff_print(timer);
+		free(timer);
+	}
+
+	if (!mesh_save(mesh, argv[2]))
+		return 1;
+	printf("Wrote %s: %d triangles, %d kd-tree nodes\n", argv[2],
+			mesh->num_triangles, mesh->num_kd_nodes);
+
+	return 0;
+}
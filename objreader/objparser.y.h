@@ -0,0 +1,118 @@
+/* A Bison parser, made by GNU Bison 3.8.2.  */
+
+/* Bison interface for Yacc-like parsers in C
+
+   Copyright (C) 1984, 1989-1990, 2000-2015, 2018-2021 Free Software Foundation,
+   Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* As a special exception, you may create a larger work that contains
+   part or all of the Bison parser skeleton and distribute that work
+   under terms of your choice, so long as that work isn't itself a
+   parser generator using the skeleton or a modified version thereof
+   as a parser skeleton.  Alternatively, if you modify or redistribute
+   the parser skeleton itself, you may (at your option) remove this
+   special exception, which will cause the skeleton and the resulting
+   Bison output files to be licensed under the GNU General Public
+   License without this special exception.
+
+   This special exception was added by the Free Software Foundation in
+   version 2.2 of Bison.  */
+
+/* DO NOT RELY ON FEATURES THAT ARE NOT DOCUMENTED in the manual,
+   especially those whose name start with YY_ or yy_.  They are
+   private implementation details that can be changed or removed.  */
+
+#ifndef YY_OBJ_OBJPARSER_Y_H_INCLUDED
+# define YY_OBJ_OBJPARSER_Y_H_INCLUDED
+/* Debug traces.  */
+#ifndef YYDEBUG
+# define YYDEBUG 0
+#endif
+#if YYDEBUG
+extern int Obj_debug;
+#endif
+
+/* Token kinds.  */
+#ifndef YYTOKENTYPE
+# define YYTOKENTYPE
+  enum yytokentype
+  {
+    YYEMPTY = -2,
+    YYEOF = 0,                     /* "end of file"  */
+    YYerror = 256,                 /* error  */
+    YYUNDEF = 257,                 /* "invalid token"  */
+    ERR = 258,                     /* ERR  */
+    EOL = 259,                     /* EOL  */
+    DECIMAL = 260,                 /* DECIMAL  */
+    INTEGER = 261,                 /* INTEGER  */
+    WORD = 262,                    /* WORD  */
+    MATERIALLIB_MARKER = 263,      /* MATERIALLIB_MARKER  */
+    MTLFILEPATH = 264,             /* MTLFILEPATH  */
+    USEMATERIAL_MARKER = 265,      /* USEMATERIAL_MARKER  */
+    NULL_MARKER = 266,             /* NULL_MARKER  */
+    VERTEX_MARKER = 267,           /* VERTEX_MARKER  */
+    TEXEL_MARKER = 268,            /* TEXEL_MARKER  */
+    NORMAL_MARKER = 269,           /* NORMAL_MARKER  */
+    LINE_MARKER = 270,             /* LINE_MARKER  */
+    FACE_MARKER = 271,             /* FACE_MARKER  */
+    GROUP_MARKER = 272,            /* GROUP_MARKER  */
+    OBJECT_MARKER = 273,           /* OBJECT_MARKER  */
+    SMOOTHINGGROUP_MARKER = 274,   /* SMOOTHINGGROUP_MARKER  */
+    CAMERA_MARKER = 275,           /* CAMERA_MARKER  */
+    OFF_WORD = 276                 /* OFF_WORD  */
+  };
+  typedef enum yytokentype yytoken_kind_t;
+#endif
+
+/* Value type.  */
+#if ! defined YYSTYPE && ! defined YYSTYPE_IS_DECLARED
+union YYSTYPE
+{
+#line 10 "wavefrontobj.y"
+
+  int intValue;    /* integer */
+  float fValue;    /* float value */
+  char *string;    /* character string */
+
+#line 91 "objparser.y.h"
+
+};
+typedef union YYSTYPE YYSTYPE;
+# define YYSTYPE_IS_TRIVIAL 1
+# define YYSTYPE_IS_DECLARED 1
+#endif
+
+/* Location type.  */
+#if ! defined YYLTYPE && ! defined YYLTYPE_IS_DECLARED
+typedef struct YYLTYPE YYLTYPE;
+struct YYLTYPE
+{
+  int first_line;
+  int first_column;
+  int last_line;
+  int last_column;
+};
+# define YYLTYPE_IS_DECLARED 1
+# define YYLTYPE_IS_TRIVIAL 1
+#endif
+
+
+
+
+int Obj_parse (ObjContext* context);
+
+
+#endif /* !YY_OBJ_OBJPARSER_Y_H_INCLUDED  */
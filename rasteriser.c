@@ -171,12 +171,11 @@ static void rasterise_mesh(Raster *raster, Mesh *mesh, Material *mat)
 	{
 		Vec4 pos[3];
 		Screen3 coord[3];
-		Triangle tri = mesh->triangle[i];
 
 		for (int j = 0; j < 3; j++)
 		{
-			Vec3 vertex = mesh->vertex[tri.vertex_index[j]];
-			Vec3 normal = mesh->normal[tri.normal_index[j]];
+			Vec3 vertex = mesh->vertex[MESH_VERTEX_INDEX(mesh, i, j)];
+			Vec3 normal = mesh->normal[MESH_NORMAL_INDEX(mesh, i, j)];
 			pos[j] = vertex_shader(vertex, normal, j);
 			coord[j] = vec3_to_screen3(pos[j]);
 		}
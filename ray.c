@@ -1,21 +1,21 @@
 #include <assert.h>
+#include <float.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
 #include "ray.h"
 
 struct TriangleHit {
-	double t;
+	Real t;
 	float a;
 	float b;
 	float c;
-	Triangle triangle;
+	uint32_t triangle;
 };
 
-double drand(void)
-{
-	return rand()/((double) RAND_MAX);
-}
-
 static Ray cam_ray_internal(Camera *cam, int i, int j, float offx, float offy,
 		double near)
 {
@@ -43,62 +43,76 @@ static Ray cam_ray_internal(Camera *cam, int i, int j, float offx, float offy,
 	return r;
 }
 
-/* Fullscreen antialiasing. Ultra-slow. */
-Ray camera_ray_aa(Camera *cam, int i, int j, int sample, double near)
+/* A ray through a random point in cell number sample of an n by n grid over
+ * the pixel. */
+Ray camera_ray_stratified(Camera *cam, int i, int j, int sample, int n,
+		double near, Rng *rng)
 {
 	float offx, offy;
 	int p, q;
-	const float n = (float) config->aa_samples;
 
-	p = sample % config->aa_samples;
-	q = sample / config->aa_samples;
-	offx = (p + drand()) / n;
-	offy = (q + drand()) / n;
+	p = sample % n;
+	q = sample / n;
+	offx = (p + rng_double(rng)) / n;
+	offy = (q + rng_double(rng)) / n;
 
 	return cam_ray_internal(cam, i, j, offx, offy, near);
 }
 
+/* Fullscreen antialiasing. Ultra-slow. */
+Ray camera_ray_aa(Camera *cam, int i, int j, int sample, double near,
+		Rng *rng)
+{
+	return camera_ray_stratified(cam, i, j, sample, config->aa_samples, near,
+			rng);
+}
+
 /* The offset 0.5 traces the ray right through the center of the pixel. */
 Ray camera_ray(Camera *cam, int i, int j, double near)
 {
 	return cam_ray_internal(cam, i, j, 0.5, 0.5, near);
 }
 
+/* Which part of a shape was hit. The intersection routines only report this
+ * and the distance; the normal is worked out later, for the closest hit only. */
+enum { PART_FRONT, PART_BACK }; /* Planes and disks */
+enum { PART_SIDE, PART_BOTTOM, PART_TOP }; /* Cylinders */
+
+static Real dot3(const Real a[3], Vec3 b)
+{
+	return a[0]*b.x + a[1]*b.y + a[2]*b.z;
+}
+
 /* Various intersection routines. The sphere and cylinder routines are the most
  * mature. */
-static int ray_plane_intersect(Ray ray, Plane plane, float t[1], Vec3 normal[1])
+static int ray_plane_intersect(Ray ray, const SurfaceRecord *rec, float t[1],
+		int part[1])
 {
-	float test_t, alpha, beta, det;
-	Vec3 a = plane.edge1, b = plane.edge2, d = ray.direction, o = ray.origin;
-	Vec3 n, axn, bxn, pos;
+	float test_t, alpha, beta;
+	Vec3 d = ray.direction, o = ray.origin, pos;
+	Real dn;
 
 	/* This is basically Cramer's rule with vector calculus */
-	n = vec3_cross(a, b);
-	test_t = -vec3_dot(o, n)/vec3_dot(d, n);
+	dn = dot3(rec->u.plane.normal, d);
+	test_t = -dot3(rec->u.plane.normal, o)/dn;
 	pos = vec3_add(o, vec3_scale(test_t, d));
 
-	axn = vec3_cross(a, n);
-	bxn = vec3_cross(b, n);
-	det = vec3_dot(a, bxn);
-
-	alpha =  vec3_dot(pos, bxn)/det;
-	beta  = -vec3_dot(pos, axn)/det;
+	alpha = dot3(rec->u.plane.alpha, pos);
+	beta  = dot3(rec->u.plane.beta, pos);
 
 	if (alpha < 0 || alpha > 1 || beta < 0 || beta > 1)
 		return 0;
 
 	t[0] = test_t;
-	if (vec3_dot(d, n) < 0)
-		normal[0] = n;
-	else
-		normal[0] = vec3_scale(-1, n);
+	part[0] = dn < 0 ? PART_FRONT : PART_BACK;
 
 	return 1;
 }
 
-static int ray_disk_intersect(Ray ray, Disk disk, float t[1], Vec3 normal[1])
+static int ray_disk_intersect(Ray ray, const SurfaceRecord *rec, float t[1],
+		int part[1])
 {
-	double tt, xx, yy;
+	Real tt, xx, yy;
 	Vec3 o = ray.origin, d = ray.direction;
 
 	if (d.z == 0)
@@ -107,60 +121,51 @@ static int ray_disk_intersect(Ray ray, Disk disk, float t[1], Vec3 normal[1])
 	tt = -o.z/d.z;
 	xx = o.x + tt*d.x;
 	yy = o.y + tt*d.y;
-	if (SQUARE(xx) + SQUARE(yy) > SQUARE(disk.radius))
+	if (SQUARE(xx) + SQUARE(yy) > rec->u.disk.radius2)
 		return 0;
 
 	t[0] = tt;
-	if (o.z + ray.near*d.z >= 0)
-		normal[0] = (Vec3) {0, 0,  1};
-	else
-		normal[0] = (Vec3) {0, 0, -1};
+	part[0] = o.z + ray.near*d.z >= 0 ? PART_FRONT : PART_BACK;
 
 	return 1;
 }
 
-static int ray_sphere_intersect(Ray r, Sphere sph, float t[2], Vec3 normal[2])
+static int ray_sphere_intersect(Ray r, const SurfaceRecord *rec, float t[2])
 {
 	Vec3 v;
 	float dd, vd, vv, discriminant;
-	float radius = sph.radius;
 
 	v = r.origin;
 	vv = vec3_dot(v, v);
 	vd = vec3_dot(v, r.direction);
 	dd = vec3_dot(r.direction, r.direction);
 
-	discriminant = vd*vd - dd*(vv - radius*radius);
+	discriminant = vd*vd - dd*(vv - rec->u.sphere.radius2);
 	if (discriminant < 0)
 		return 0;
 	else if (discriminant == 0)
 	{
 		t[0] = -vd/dd;
-		normal[0] = vec3_normalize(vec3_add(r.origin,
-				vec3_scale(t[0], r.direction)));
 		return 1;
 	} else
 	{
 		t[0] = (-vd - sqrtf(discriminant))/dd;
 		t[1] = (-vd + sqrtf(discriminant))/dd;
-
-		normal[0] = vec3_add(r.origin, vec3_scale(t[0], r.direction));
-		normal[1] = vec3_add(r.origin, vec3_scale(t[1], r.direction));
 		return 2;
 	}
 }
 
-static int ray_cylinder_intersect(Ray ray, Cylinder cyl, float t[2],
-		Vec3 normal[2])
+static int ray_cylinder_intersect(Ray ray, const SurfaceRecord *rec,
+		float t[2], int part[2])
 {
-	const float height = cyl.height, radius = cyl.radius;
+	const float height = rec->u.cylinder.height;
 	const Vec3 o = ray.origin, d = ray.direction;
 	float a, b, c, disc, z0, z1;
-	bool capped = cyl.capped;
+	bool capped = rec->u.cylinder.capped;
 
 	a = SQUARE(d.x) + SQUARE(d.y);
 	b = 2*(o.x*d.x + o.y*d.y);
-	c = SQUARE(o.x) + SQUARE(o.y) - SQUARE(radius);
+	c = SQUARE(o.x) + SQUARE(o.y) - rec->u.cylinder.radius2;
 
 	/* If the projection of the ray on the XY plane doesn't cross the circle
 	 * formed by the projection of the cylinder, it certainly never intersects
@@ -171,13 +176,9 @@ static int ray_cylinder_intersect(Ray ray, Cylinder cyl, float t[2],
 
 	/* The preliminary intersection points. These might be too high or low. */
 	t[0] = (-b-sqrtf(disc))/(2*a);
-	normal[0].x = (o.x + t[0]*d.x)/radius;
-	normal[0].y = (o.y + t[0]*d.y)/radius;
-	normal[0].z = 0;
+	part[0] = PART_SIDE;
 	t[1] = (-b+sqrtf(disc))/(2*a);
-	normal[1].x = (o.x + t[1]*d.x)/radius;
-	normal[1].y = (o.y + t[1]*d.y)/radius;
-	normal[1].z = 0;
+	part[1] = PART_SIDE;
 
 	/* The heights will determine whether we hit the actual cylinder, a cap or
 	 * went straight over or under */
@@ -195,9 +196,9 @@ static int ray_cylinder_intersect(Ray ray, Cylinder cyl, float t[2],
 		/* The order of t[0] and t[1] is arbitrary, there's no guarantee t[0]
 		 * will be the closest intersection point. */
 		t[0] = -o.z/d.z;
-		normal[0] = (Vec3) {0, 0, -1};
+		part[0] = PART_BOTTOM;
 		t[1] = (height - o.z)/d.z;
-		normal[1] = (Vec3) {0, 0, 1};
+		part[1] = PART_TOP;
 	}
 	else if (z0 >= 0 && z0 <= height && z1 > height)
 	{
@@ -206,11 +207,11 @@ static int ray_cylinder_intersect(Ray ray, Cylinder cyl, float t[2],
 		if (capped)
 		{
 			t[1] = (height - o.z)/d.z;
-			normal[1] = (Vec3) {0, 0, 1};
+			part[1] = PART_TOP;
 		} else
 		{
 			t[1] = t[0];
-			normal[1] = normal[0];
+			part[1] = part[0];
 		}
 	}
 	else if (z0 >= 0 && z0 <= height && z1 < 0)
@@ -219,12 +220,12 @@ static int ray_cylinder_intersect(Ray ray, Cylinder cyl, float t[2],
 		if (capped)
 		{
 			t[1] = -o.z/d.z;
-			normal[1] = (Vec3) {0, 0, -1};
+			part[1] = PART_BOTTOM;
 		}
 		else
 		{
 			t[1] = t[0];
-			normal[1] = normal[0];
+			part[1] = part[0];
 		}
 	}
 	else if (z1 >= 0 && z1 <= height && z0 > height)
@@ -234,12 +235,12 @@ static int ray_cylinder_intersect(Ray ray, Cylinder cyl, float t[2],
 		if (capped)
 		{
 			t[0] = (height - o.z)/d.z;
-			normal[0] = (Vec3) {0, 0, 1};
+			part[0] = PART_TOP;
 		}
 		else
 		{
 			t[0] = t[1];
-			normal[0] = normal[1];
+			part[0] = part[1];
 		}
 	}
 	else if (z1 >= 0 && z1 <= height && z0 < 0)
@@ -248,12 +249,12 @@ static int ray_cylinder_intersect(Ray ray, Cylinder cyl, float t[2],
 		if (capped)
 		{
 			t[0] = -o.z/d.z;
-			normal[0] = (Vec3) {0, 0, -1};
+			part[0] = PART_BOTTOM;
 		}
 		else
 		{
 			t[0] = t[1];
-			normal[0] = normal[1];
+			part[0] = part[1];
 		}
 	}
 	else if (z0 >= 0 && z0 <= height && z1 >= 0 && z1 <= height)
@@ -270,9 +271,9 @@ static int ray_cylinder_intersect(Ray ray, Cylinder cyl, float t[2],
 	return 2;
 }
 
-static int ray_cone_intersect(Ray ray, Cone cone, float t[2], Vec3 normal[2])
+static int ray_cone_intersect(Ray ray, const SurfaceRecord *rec, float t[2])
 {
-	float dx, dy, dz, ox, oy, oz, R, h;
+	float dx, dy, dz, ox, oy, oz, k2, h;
 	float a, b, c, disc;
 	float z0, z1;
 
@@ -284,12 +285,12 @@ static int ray_cone_intersect(Ray ray, Cone cone, float t[2], Vec3 normal[2])
 	oy = ray.origin.y;
 	oz = ray.origin.z;
 
-	R = cone.radius;
-	h = cone.height;
+	k2 = rec->u.cone.k2;
+	h = rec->u.cone.height;
 
-	a = SQUARE(dx) + SQUARE(dy) - SQUARE(R/h*dz);
-	b = 2*(ox*dx + oy*dy + SQUARE(R/h)*(- oz*dz + h*dz));
-	c = SQUARE(ox) + SQUARE(oy) - SQUARE(R/h)*(SQUARE(h) - 2*h*oz + SQUARE(oz));
+	a = SQUARE(dx) + SQUARE(dy) - k2*SQUARE(dz);
+	b = 2*(ox*dx + oy*dy + k2*(- oz*dz + h*dz));
+	c = SQUARE(ox) + SQUARE(oy) - k2*(SQUARE(h) - 2*h*oz + SQUARE(oz));
 
 	disc = b*b - 4*a*c;
 	if (disc < 0)
@@ -308,135 +309,316 @@ static int ray_cone_intersect(Ray ray, Cone cone, float t[2], Vec3 normal[2])
 	else if (z1 > h || z1 < 0)
 		t[1] = t[0];
 
-	normal[0].x = h/sqrtf(h*h+R*R)*(ox+t[0]*dx)/
-			sqrtf(SQUARE(ox+t[0]*dx) + SQUARE(oy+t[0]*dy));
-	normal[0].y = h/sqrtf(h*h+R*R)*(oy+t[0]*dy)/
-			sqrtf(SQUARE(ox+t[0]*dx) + SQUARE(oy+t[0]*dy));
-	normal[0].z = R/sqrtf(h*h+R*R);
-
-	normal[1].x = h/sqrtf(h*h+R*R)*(ox+t[1]*dx)/
-			sqrtf(SQUARE(ox+t[1]*dx) + SQUARE(oy+t[1]*dy));
-	normal[1].y = h/sqrtf(h*h+R*R)*(oy+t[1]*dy)/
-			sqrtf(SQUARE(ox+t[1]*dx) + SQUARE(oy+t[1]*dy));
-	normal[1].z = R/sqrtf(h*h+R*R);
-
 	return 1;
 }
 
-/* This is basically Cramer's rule, but with vector calculus. */
-static bool ray_triangle_intersect(Ray ray, Vec3 u, Vec3 v, Vec3 w,
-		struct TriangleHit *tri_hit)
+/* The Möller-Trumbore test of a ray against every triangle in a block at
+ * once. The lanes that hit between near and far come back as a bitmask, with
+ * their distance and barycentric coordinates in t, b and c. */
+#if defined(__AVX__)
+typedef __m256 KdLanes;
+#define LANES_SET1(x) _mm256_set1_ps(x)
+#define LANES_LOAD(p) _mm256_loadu_ps(p)
+#define LANES_STORE(p, x) _mm256_storeu_ps(p, x)
+#define LANES_ADD(x, y) _mm256_add_ps(x, y)
+#define LANES_SUB(x, y) _mm256_sub_ps(x, y)
+#define LANES_MUL(x, y) _mm256_mul_ps(x, y)
+#define LANES_DIV(x, y) _mm256_div_ps(x, y)
+#define LANES_AND(x, y) _mm256_and_ps(x, y)
+#define LANES_GE(x, y) _mm256_cmp_ps(x, y, _CMP_GE_OQ)
+#define LANES_LE(x, y) _mm256_cmp_ps(x, y, _CMP_LE_OQ)
+#define LANES_NE(x, y) _mm256_cmp_ps(x, y, _CMP_NEQ_OQ)
+#define LANES_MIN(x, y) _mm256_min_ps(x, y)
+#define LANES_MAX(x, y) _mm256_max_ps(x, y)
+#define LANES_MASK(x) _mm256_movemask_ps(x)
+#elif defined(__SSE__)
+typedef __m128 KdLanes;
+#define LANES_SET1(x) _mm_set1_ps(x)
+#define LANES_LOAD(p) _mm_loadu_ps(p)
+#define LANES_STORE(p, x) _mm_storeu_ps(p, x)
+#define LANES_ADD(x, y) _mm_add_ps(x, y)
+#define LANES_SUB(x, y) _mm_sub_ps(x, y)
+#define LANES_MUL(x, y) _mm_mul_ps(x, y)
+#define LANES_DIV(x, y) _mm_div_ps(x, y)
+#define LANES_AND(x, y) _mm_and_ps(x, y)
+#define LANES_GE(x, y) _mm_cmpge_ps(x, y)
+#define LANES_LE(x, y) _mm_cmple_ps(x, y)
+#define LANES_NE(x, y) _mm_cmpneq_ps(x, y)
+#define LANES_MIN(x, y) _mm_min_ps(x, y)
+#define LANES_MAX(x, y) _mm_max_ps(x, y)
+#define LANES_MASK(x) _mm_movemask_ps(x)
+#endif
+
+#ifdef LANES_SET1
+static unsigned ray_block_intersect(const float o[3], const float d[3],
+		float near, float far, const KdTriangleBlock *block,
+		float t[KD_SIMD_WIDTH], float b[KD_SIMD_WIDTH], float c[KD_SIMD_WIDTH])
 {
-	Vec3 edge1, edge2, tvec, pvec, qvec;
-	float det;
-	float aa, bb, cc;
+	const KdLanes zero = LANES_SET1(0), one = LANES_SET1(1);
+	KdLanes e1[3], e2[3], tvec[3], pvec[3], qvec[3];
+	KdLanes det, inv_det, bb, cc, tt, mask;
 
-	edge1 = vec3_sub(v, u);
-	edge2 = vec3_sub(w, u);
+	for (int k = 0; k < 3; k++)
+	{
+		e1[k] = LANES_LOAD(block->edge1[k]);
+		e2[k] = LANES_LOAD(block->edge2[k]);
+		tvec[k] = LANES_SUB(LANES_SET1(o[k]), LANES_LOAD(block->vertex[k]));
+	}
 
-	pvec = vec3_cross(ray.direction, edge2);
-	det = vec3_dot(edge1, pvec);
+	/* pvec = d x e2 */
+	pvec[0] = LANES_SUB(LANES_MUL(LANES_SET1(d[1]), e2[2]),
+			LANES_MUL(LANES_SET1(d[2]), e2[1]));
+	pvec[1] = LANES_SUB(LANES_MUL(LANES_SET1(d[2]), e2[0]),
+			LANES_MUL(LANES_SET1(d[0]), e2[2]));
+	pvec[2] = LANES_SUB(LANES_MUL(LANES_SET1(d[0]), e2[1]),
+			LANES_MUL(LANES_SET1(d[1]), e2[0]));
+	det = LANES_ADD(LANES_ADD(LANES_MUL(e1[0], pvec[0]),
+			LANES_MUL(e1[1], pvec[1])), LANES_MUL(e1[2], pvec[2]));
+	/* The padding is degenerate, so this masks it out as well */
+	mask = LANES_NE(det, zero);
+	inv_det = LANES_DIV(one, det);
+
+	bb = LANES_MUL(inv_det, LANES_ADD(LANES_ADD(LANES_MUL(tvec[0], pvec[0]),
+			LANES_MUL(tvec[1], pvec[1])), LANES_MUL(tvec[2], pvec[2])));
+	mask = LANES_AND(mask, LANES_AND(LANES_GE(bb, zero), LANES_LE(bb, one)));
+
+	/* qvec = tvec x e1 */
+	qvec[0] = LANES_SUB(LANES_MUL(tvec[1], e1[2]), LANES_MUL(tvec[2], e1[1]));
+	qvec[1] = LANES_SUB(LANES_MUL(tvec[2], e1[0]), LANES_MUL(tvec[0], e1[2]));
+	qvec[2] = LANES_SUB(LANES_MUL(tvec[0], e1[1]), LANES_MUL(tvec[1], e1[0]));
+	cc = LANES_MUL(inv_det, LANES_ADD(LANES_ADD(
+			LANES_MUL(LANES_SET1(d[0]), qvec[0]),
+			LANES_MUL(LANES_SET1(d[1]), qvec[1])),
+			LANES_MUL(LANES_SET1(d[2]), qvec[2])));
+	mask = LANES_AND(mask, LANES_AND(LANES_GE(cc, zero),
+			LANES_LE(LANES_ADD(bb, cc), one)));
+
+	tt = LANES_MUL(inv_det, LANES_ADD(LANES_ADD(LANES_MUL(e2[0], qvec[0]),
+			LANES_MUL(e2[1], qvec[1])), LANES_MUL(e2[2], qvec[2])));
+	mask = LANES_AND(mask, LANES_AND(LANES_GE(tt, LANES_SET1(near)),
+			LANES_LE(tt, LANES_SET1(far))));
+
+	LANES_STORE(t, tt);
+	LANES_STORE(b, bb);
+	LANES_STORE(c, cc);
+
+	return LANES_MASK(mask);
+}
+#else
+/* The scalar fallback, one lane at a time */
+static unsigned ray_block_intersect(const float o[3], const float d[3],
+		float near, float far, const KdTriangleBlock *block,
+		float t[KD_SIMD_WIDTH], float b[KD_SIMD_WIDTH], float c[KD_SIMD_WIDTH])
+{
+	unsigned mask = 0;
 
-	tvec = vec3_sub(ray.origin, u);
-	bb = vec3_dot(tvec, pvec) / det;
-	if (bb < 0.0 || bb > 1.0)
-		return false;
+	for (int i = 0; i < KD_SIMD_WIDTH; i++)
+	{
+		float e1[3], e2[3], tvec[3], pvec[3], qvec[3];
+		float det, inv_det;
 
-	qvec = vec3_cross(tvec, edge1);
-	cc = vec3_dot(ray.direction, qvec) / det;
-	if (cc < 0.0 || cc + bb > 1.0)
-		return false;
+		for (int k = 0; k < 3; k++)
+		{
+			e1[k] = block->edge1[k][i];
+			e2[k] = block->edge2[k][i];
+			tvec[k] = o[k] - block->vertex[k][i];
+		}
+		pvec[0] = d[1]*e2[2] - d[2]*e2[1];
+		pvec[1] = d[2]*e2[0] - d[0]*e2[2];
+		pvec[2] = d[0]*e2[1] - d[1]*e2[0];
+		det = e1[0]*pvec[0] + e1[1]*pvec[1] + e1[2]*pvec[2];
+		if (det == 0)
+			continue;
+		inv_det = 1/det;
+
+		b[i] = inv_det*(tvec[0]*pvec[0] + tvec[1]*pvec[1] + tvec[2]*pvec[2]);
+		if (b[i] < 0 || b[i] > 1)
+			continue;
 
-	aa = 1.0 - bb - cc;
+		qvec[0] = tvec[1]*e1[2] - tvec[2]*e1[1];
+		qvec[1] = tvec[2]*e1[0] - tvec[0]*e1[2];
+		qvec[2] = tvec[0]*e1[1] - tvec[1]*e1[0];
+		c[i] = inv_det*(d[0]*qvec[0] + d[1]*qvec[1] + d[2]*qvec[2]);
+		if (c[i] < 0 || b[i] + c[i] > 1)
+			continue;
 
-	tri_hit->a = aa;
-	tri_hit->b = bb;
-	tri_hit->c = cc;
-	tri_hit->t = vec3_dot(edge2, qvec) / det;
+		t[i] = inv_det*(e2[0]*qvec[0] + e2[1]*qvec[1] + e2[2]*qvec[2]);
+		if (t[i] >= near && t[i] <= far)
+			mask |= 1u << i;
+	}
 
-	return true;
+	return mask;
 }
+#endif
+
+/* The slab test of a ray against the boxes of all children of a BVH node at
+ * once. The lanes whose box the ray passes through between near and far come
+ * back as a bitmask, with the distance at which the ray enters them in t.
+ * The exit distance is pushed out a little, so rounding can't make the ray
+ * slip past a flat box, like that of a single axis aligned triangle. */
+#define BVH_ROBUST_FAR (1 + 4*FLT_EPSILON)
+
+#ifdef LANES_SET1
+static unsigned ray_bvh_node_test(const float o[3], const float inv_dir[3],
+		const bool positive[3], float near, float far,
+		const MeshBvhNode *node, float t[MESH_BVH_WIDTH])
+{
+	KdLanes tmin = LANES_SET1(near), tmax = LANES_SET1(far);
+
+	for (int k = 0; k < 3; k++)
+	{
+		const KdLanes origin = LANES_SET1(o[k]), inv = LANES_SET1(inv_dir[k]);
+		const float *enter = positive[k] ? node->lo[k] : node->hi[k];
+		const float *leave = positive[k] ? node->hi[k] : node->lo[k];
+
+		/* A ray in the plane of a side gives NaN, and MIN and MAX return
+		 * their second operand for that, leaving the bounds as they are */
+		tmin = LANES_MAX(LANES_MUL(LANES_SUB(LANES_LOAD(enter), origin), inv),
+				tmin);
+		tmax = LANES_MIN(LANES_MUL(LANES_SUB(LANES_LOAD(leave), origin), inv),
+				tmax);
+	}
+	LANES_STORE(t, tmin);
 
-static bool ray_kd_leaf_intersect(Ray ray, const Vec3 *vertex_list,
-		const KdNode *leaf,	struct TriangleHit *hit)
+	return LANES_MASK(LANES_LE(tmin,
+			LANES_MUL(tmax, LANES_SET1(BVH_ROBUST_FAR))));
+}
+#else
+static unsigned ray_bvh_node_test(const float o[3], const float inv_dir[3],
+		const bool positive[3], float near, float far,
+		const MeshBvhNode *node, float t[MESH_BVH_WIDTH])
 {
+	unsigned mask = 0;
 
-	struct TriangleHit final_hit;
-	final_hit.t = HUGE_VAL;
-	for (int i = 0; i < leaf->num_triangles; i++)
+	for (int i = 0; i < MESH_BVH_WIDTH; i++)
 	{
-		struct TriangleHit nhit;
-		Triangle tri = leaf->triangle[i];
-		Vec3 u = vertex_list[tri.vertex_index[0]];
-		Vec3 v = vertex_list[tri.vertex_index[1]];
-		Vec3 w = vertex_list[tri.vertex_index[2]];
+		float tmin = near, tmax = far;
 
-		if (ray_triangle_intersect(ray, u, v, w, &nhit))
+		for (int k = 0; k < 3; k++)
 		{
-			if (nhit.t >= ray.near && nhit.t <= final_hit.t && nhit.t <= ray.far)
-			{
-				final_hit = nhit;
-				final_hit.triangle = tri;
-			}
+			float t0 = ((positive[k] ? node->lo : node->hi)[k][i] - o[k]) *
+					inv_dir[k];
+			float t1 = ((positive[k] ? node->hi : node->lo)[k][i] - o[k]) *
+					inv_dir[k];
+
+			/* False for NaN as well */
+			if (t0 > tmin)
+				tmin = t0;
+			if (t1 < tmax)
+				tmax = t1;
 		}
+		t[i] = tmin;
+		if (tmin <= tmax * BVH_ROBUST_FAR)
+			mask |= 1u << i;
 	}
-	if (final_hit.t < HUGE_VAL)
+
+	return mask;
+}
+#endif
+
+/* The closest hit with the num_triangles triangles of a leaf, which start at
+ * block and whose indices in the mesh start at index */
+static bool ray_leaf_intersect(Ray ray, const KdTriangleBlock *block,
+		const uint32_t *index, uint32_t num_triangles, struct TriangleHit *hit)
+{
+	const float o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+	const float d[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+	float t[KD_SIMD_WIDTH], b[KD_SIMD_WIDTH], c[KD_SIMD_WIDTH];
+	float far = ray.far;
+	int best = -1;
+	float best_b = 0, best_c = 0;
+
+	for (uint32_t i = 0; i < num_triangles; i += KD_SIMD_WIDTH)
 	{
-		*hit = final_hit;
-		return true;
+		unsigned mask = ray_block_intersect(o, d, ray.near, far, block++, t, b, c);
+
+		for (int lane = 0; mask != 0; lane++, mask >>= 1)
+		{
+			if (!(mask & 1) || t[lane] > far)
+				continue;
+
+			far = t[lane];
+			best = i + lane;
+			best_b = b[lane];
+			best_c = c[lane];
+		}
 	}
-	else
+	if (best < 0)
 		return false;
+
+	hit->t = far;
+	hit->a = 1 - best_b - best_c;
+	hit->b = best_b;
+	hit->c = best_c;
+	hit->triangle = index[best];
+	return true;
+}
+
+static bool ray_kd_leaf_intersect(Ray ray, const Mesh *mesh,
+		const KdFlatNode *leaf, struct TriangleHit *hit)
+{
+	const uint32_t offset = KD_NODE_OFFSET(leaf);
+
+	return ray_leaf_intersect(ray, &mesh->kd_block[offset / KD_SIMD_WIDTH],
+			&mesh->kd_index[offset], leaf->u.num_triangles, hit);
 }
 
-static bool ray_kd_tree_intersect(Ray ray, const Vec3 *vertex_list,
-		const KdNode *node, struct TriangleHit *hit)
+#ifndef NDEBUG
+/* The original recursive traversal, kept around to check the iterative one
+ * against in debug builds. */
+static bool ray_kd_tree_intersect_recursive(Ray ray, const Mesh *mesh,
+		const KdFlatNode *node, struct TriangleHit *hit)
 {
 	const Vec3 plane_normal[3] =
 			{(Vec3) {1, 0, 0}, (Vec3) {0, 1, 0}, (Vec3) {0, 0, 1}};
-	KdNode *node_near, *node_far;
+	const KdFlatNode *children;
+	const KdFlatNode *node_near, *node_far;
 	struct TriangleHit hit_near, hit_far;
 	bool did_near, did_far;
 	Ray ray_near = ray, ray_far = ray;
-	double clip_t;
+	Real clip_t;
+
+	if (KD_NODE_FLAGS(node) == KD_UNBUILT)
+		mesh_expand_kd_node(mesh, node);
 
 	/* In a leaf we have to check all triangles */
-	if (node->leaf)
-		return ray_kd_leaf_intersect(ray, vertex_list, node, hit);
+	if (KD_NODE_AXIS(node) == KD_LEAF)
+		return ray_kd_leaf_intersect(ray, mesh, node, hit);
 
-	switch(node->axis)
+	switch(KD_NODE_AXIS(node))
 	{
 	case X_AXIS:
-		clip_t = (node->location - ray.origin.x)/ray.direction.x;
+		clip_t = (node->u.split - ray.origin.x)/ray.direction.x;
 		break;
 	case Y_AXIS:
-		clip_t = (node->location - ray.origin.y)/ray.direction.y;
+		clip_t = (node->u.split - ray.origin.y)/ray.direction.y;
 		break;
 	case Z_AXIS:
-		clip_t = (node->location - ray.origin.z)/ray.direction.z;
+		clip_t = (node->u.split - ray.origin.z)/ray.direction.z;
 		break;
 	default:
-		printf("Invalid axis %d\n", node->axis);
+		printf("Invalid axis %d\n", KD_NODE_AXIS(node));
 		exit(1);
 		break;
 	}
 
-	if (vec3_dot(ray.direction, plane_normal[node->axis]) > 0.0)
+	children = &mesh->kd_node[KD_NODE_OFFSET(node)];
+	if (vec3_dot(ray.direction, plane_normal[KD_NODE_AXIS(node)]) > 0.0)
 	{
-		node_near = node->left;
-		node_far = node->right;
+		node_near = &children[0];
+		node_far = &children[1];
 	} else
 	{
-		node_near = node->right;
-		node_far = node->left;
+		node_near = &children[1];
+		node_far = &children[0];
 	}
 
 	/* The major performance improvement from using kd-trees
 	 * Don't check a branch of a tree if the ray can't possibly intersect it */
 	if (clip_t > ray.far)
-		return ray_kd_tree_intersect(ray, vertex_list, node_near, hit);
+		return ray_kd_tree_intersect_recursive(ray, mesh, node_near, hit);
 	if (clip_t < ray.near)
-		return ray_kd_tree_intersect(ray, vertex_list, node_far, hit);
+		return ray_kd_tree_intersect_recursive(ray, mesh, node_far, hit);
 
 	/* Split the ray in twain */
 	ray_near.near = ray.near; ray_near.far = clip_t;
@@ -446,7 +628,8 @@ static bool ray_kd_tree_intersect(Ray ray, const Vec3 *vertex_list,
 	 * be closer than any point in the far node. So we start by checking the
 	 * near node and if we find an intersection inside it, we don't check the
 	 * far node anymore as it can't possible contain a closer intersection. */
-	did_near = ray_kd_tree_intersect(ray_near, vertex_list, node_near, &hit_near);
+	did_near = ray_kd_tree_intersect_recursive(ray_near, mesh, node_near,
+			&hit_near);
 	/* The test (hit_near.t < clip_t) is important, as it is possible a
 	 * primitive in the far node will intersect closer than this primitive,
 	 * which lies only partially in the near node. */
@@ -456,73 +639,426 @@ static bool ray_kd_tree_intersect(Ray ray, const Vec3 *vertex_list,
 		return true;
 	}
 
-	did_far = ray_kd_tree_intersect(ray_far, vertex_list, node_far, &hit_far);
+	did_far = ray_kd_tree_intersect_recursive(ray_far, mesh, node_far, &hit_far);
 	*hit = hit_far;
 	return did_far;
 }
+#endif
 
-static int ray_mesh_intersect(Ray ray, const Mesh *mesh, float *t, Vec3 *normal)
+enum { KD_STACK_SIZE = KD_MAX_DEPTH };
+
+static bool ray_kd_tree_intersect(Ray ray, const Mesh *mesh,
+		struct TriangleHit *hit)
 {
-	struct TriangleHit tri_hit;
+	struct {
+		const KdFlatNode *node;
+		float near, far;
+	} stack[KD_STACK_SIZE];
+	const Real origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+	const Real inv_dir[3] =
+			{1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z};
+	const bool positive[3] =
+			{ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+	const KdFlatNode *node = mesh->kd_node;
+	float near = ray.near, far = ray.far;
+	int top = 0;
+
+	for (;;)
+	{
+		const KdFlatNode *children, *node_near, *node_far;
+		unsigned int axis = KD_NODE_AXIS(node);
+		Real clip_t;
 
-	if (ray_kd_tree_intersect(ray, mesh->vertex, mesh->kd_tree, &tri_hit))
+		if (axis == KD_LEAF)
+		{
+			Ray leaf_ray = ray;
+
+			if (KD_NODE_FLAGS(node) == KD_UNBUILT)
+			{
+				node = mesh_expand_kd_node(mesh, node);
+				continue;
+			}
+
+			/* Leaves are visited front to back and only accept hits
+			 * inside their own stretch of the ray, so the first hit is
+			 * the closest one. */
+			leaf_ray.near = near;
+			leaf_ray.far = far;
+			if (ray_kd_leaf_intersect(leaf_ray, mesh, node, hit))
+				return true;
+			if (top == 0)
+				return false;
+
+			top--;
+			node = stack[top].node;
+			near = stack[top].near;
+			far = stack[top].far;
+			continue;
+		}
+
+		clip_t = (node->u.split - origin[axis]) * inv_dir[axis];
+		children = &mesh->kd_node[KD_NODE_OFFSET(node)];
+		node_near = &children[!positive[axis]];
+		node_far = &children[positive[axis]];
+
+		/* Don't visit a child the ray doesn't pass through */
+		if (clip_t > far)
+			node = node_near;
+		else if (clip_t < near)
+			node = node_far;
+		else
+		{
+			assert(top < KD_STACK_SIZE);
+			stack[top].node = node_far;
+			stack[top].near = clip_t;
+			stack[top].far = far;
+			top++;
+
+			node = node_near;
+			far = clip_t;
+		}
+	}
+}
+
+/* Any triangle of the leaf hit between near and far will do */
+static bool ray_leaf_occluded(Ray ray, const KdTriangleBlock *block,
+		uint32_t num_triangles)
+{
+	const float o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+	const float d[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+	float t[KD_SIMD_WIDTH], b[KD_SIMD_WIDTH], c[KD_SIMD_WIDTH];
+
+	for (uint32_t i = 0; i < num_triangles; i += KD_SIMD_WIDTH)
+		if (ray_block_intersect(o, d, ray.near, ray.far, block++, t, b, c))
+			return true;
+
+	return false;
+}
+
+static bool ray_kd_leaf_occluded(Ray ray, const Mesh *mesh,
+		const KdFlatNode *leaf)
+{
+	return ray_leaf_occluded(ray,
+			&mesh->kd_block[KD_NODE_OFFSET(leaf) / KD_SIMD_WIDTH],
+			leaf->u.num_triangles);
+}
+
+/* Like ray_kd_tree_intersect(), but it stops at the first leaf with any hit
+ * on the ray, which needn't be the closest. */
+static bool ray_kd_tree_occluded(Ray ray, const Mesh *mesh)
+{
+	struct {
+		const KdFlatNode *node;
+		float near, far;
+	} stack[KD_STACK_SIZE];
+	const Real origin[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+	const Real inv_dir[3] =
+			{1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z};
+	const bool positive[3] =
+			{ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+	const KdFlatNode *node = mesh->kd_node;
+	float near = ray.near, far = ray.far;
+	int top = 0;
+
+	for (;;)
 	{
-		Triangle tri = tri_hit.triangle;
-		*t = tri_hit.t;
-		*normal = vec3_add(vec3_add(
-				vec3_scale(tri_hit.a, mesh->normal[tri.normal_index[0]]),
-				vec3_scale(tri_hit.b, mesh->normal[tri.normal_index[1]])),
-				vec3_scale(tri_hit.c, mesh->normal[tri.normal_index[2]]));
-		return 1;
+		const KdFlatNode *children, *node_near, *node_far;
+		unsigned int axis = KD_NODE_AXIS(node);
+		Real clip_t;
+
+		if (axis == KD_LEAF)
+		{
+			if (KD_NODE_FLAGS(node) == KD_UNBUILT)
+			{
+				node = mesh_expand_kd_node(mesh, node);
+				continue;
+			}
+
+			if (ray_kd_leaf_occluded(ray, mesh, node))
+				return true;
+			if (top == 0)
+				return false;
+
+			top--;
+			node = stack[top].node;
+			near = stack[top].near;
+			far = stack[top].far;
+			continue;
+		}
+
+		clip_t = (node->u.split - origin[axis]) * inv_dir[axis];
+		children = &mesh->kd_node[KD_NODE_OFFSET(node)];
+		node_near = &children[!positive[axis]];
+		node_far = &children[positive[axis]];
+
+		if (clip_t > far)
+			node = node_near;
+		else if (clip_t < near)
+			node = node_far;
+		else
+		{
+			assert(top < KD_STACK_SIZE);
+			stack[top].node = node_far;
+			stack[top].near = clip_t;
+			stack[top].far = far;
+			top++;
+
+			node = node_near;
+			far = clip_t;
+		}
 	}
+}
+
+/* Every wide node on the way down leaves at most all but one of its children
+ * on the stack */
+enum { BVH_STACK_SIZE = MESH_BVH_MAX_DEPTH * (MESH_BVH_WIDTH - 1) + 1 };
+
+/* The children of a BVH node that the ray passes through are visited front
+ * to back: the leaves are tested straight away, which shortens the ray, and
+ * the inner nodes are pushed with the closest one on top. Anything that turns
+ * out to lie behind a hit by the time it's popped is skipped. */
+static bool ray_bvh_intersect(Ray ray, const Mesh *mesh,
+		struct TriangleHit *hit)
+{
+	struct {
+		uint32_t node;
+		float near;
+	} stack[BVH_STACK_SIZE];
+	const float o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+	const float inv_dir[3] =
+			{1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z};
+	/* From the reciprocal, so that a +0 direction goes the way of its
+	 * +inf and enters the boxes at their lower sides */
+	const bool positive[3] =
+			{inv_dir[0] >= 0, inv_dir[1] >= 0, inv_dir[2] >= 0};
+	float far = ray.far;
+	bool did_hit = false;
+	int top = 0;
+
+	stack[top].node = 0;
+	stack[top].near = ray.near;
+	top++;
+	while (top > 0)
+	{
+		const MeshBvhNode *node;
+		float t[MESH_BVH_WIDTH];
+		int order[MESH_BVH_WIDTH], n = 0;
+		unsigned mask;
+
+		top--;
+		if (stack[top].near > far)
+			continue;
+		node = &mesh->bvh_node[stack[top].node];
+		mask = ray_bvh_node_test(o, inv_dir, positive, ray.near, far, node, t);
+
+		for (int i = 0; mask != 0; i++, mask >>= 1)
+		{
+			int j;
 
-	return 0;
+			if (!(mask & 1))
+				continue;
+			if (node->num_triangles[i] > 0)
+			{
+				const uint32_t first = node->child[i];
+				Ray leaf_ray = ray;
+
+				leaf_ray.far = far;
+				if (ray_leaf_intersect(leaf_ray,
+						&mesh->bvh_block[first / KD_SIMD_WIDTH],
+						&mesh->bvh_index[first], node->num_triangles[i], hit))
+				{
+					far = hit->t;
+					did_hit = true;
+				}
+				continue;
+			}
+
+			/* Sorted by decreasing distance */
+			for (j = n++; j > 0 && t[order[j - 1]] < t[i]; j--)
+				order[j] = order[j - 1];
+			order[j] = i;
+		}
+
+		for (int j = 0; j < n; j++)
+		{
+			if (t[order[j]] > far)
+				continue;
+			assert(top < BVH_STACK_SIZE);
+			stack[top].node = node->child[order[j]];
+			stack[top].near = t[order[j]];
+			top++;
+		}
+	}
 
+	return did_hit;
 }
 
-static bool ray_surface_intersect(Ray ray, const Surface *surf, Hit *hit)
+/* Like ray_bvh_intersect(), but any hit will do */
+static bool ray_bvh_occluded(Ray ray, const Mesh *mesh)
 {
-	float ts[2] = {-HUGE_VAL, -HUGE_VAL}, t;
-	Vec3 tnormals[2] = {{0,0,0},{0,0,0}}, tnormal;
-	Ray tray;
-	Mat4 normal_matrix;
-	Shape *shape = surf->shape;
-	int hits;
+	uint32_t stack[BVH_STACK_SIZE];
+	const float o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+	const float inv_dir[3] =
+			{1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z};
+	const bool positive[3] =
+			{inv_dir[0] >= 0, inv_dir[1] >= 0, inv_dir[2] >= 0};
+	int top = 0;
+
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const MeshBvhNode *node = &mesh->bvh_node[stack[--top]];
+		float t[MESH_BVH_WIDTH];
+		unsigned mask;
 
-	mat4_copy(normal_matrix, surf->world_to_model);
-	mat4_transpose(normal_matrix);
+		mask = ray_bvh_node_test(o, inv_dir, positive, ray.near, ray.far,
+				node, t);
+		for (int i = 0; mask != 0; i++, mask >>= 1)
+		{
+			if (!(mask & 1))
+				continue;
+			if (node->num_triangles[i] == 0)
+			{
+				assert(top < BVH_STACK_SIZE);
+				stack[top++] = node->child[i];
+			} else if (ray_leaf_occluded(ray,
+					&mesh->bvh_block[node->child[i] / KD_SIMD_WIDTH],
+					node->num_triangles[i]))
+				return true;
+		}
+	}
 
-	tray.origin = mat4_transform3_homo(surf->world_to_model, ray.origin);
-	tray.direction = mat4_transform3_hetero(surf->world_to_model, ray.direction);
-	tray.near = ray.near;
-	tray.far = ray.far;
+	return false;
+}
+
+/* A ray in the mesh's model space, through whichever structure the mesh
+ * uses */
+bool ray_mesh_intersect(Ray ray, const Mesh *mesh, Hit *hit)
+{
+	struct TriangleHit tri_hit;
+	bool did_hit;
+
+	if (mesh->accel == MESH_BVH)
+		did_hit = ray_bvh_intersect(ray, mesh, &tri_hit);
+	else
+		did_hit = ray_kd_tree_intersect(ray, mesh, &tri_hit);
+#ifndef NDEBUG
+	if (mesh->accel == MESH_KD_TREE)
+	{
+		struct TriangleHit rec_hit;
+		bool rec_did_hit;
 
-	switch(shape->type)
+		rec_did_hit = ray_kd_tree_intersect_recursive(ray, mesh, mesh->kd_node,
+				&rec_hit);
+		assert(did_hit == rec_did_hit);
+		assert(!did_hit || fabs(tri_hit.t - rec_hit.t) <= 1e-4*MAX(1, rec_hit.t));
+	}
+#endif
+	if (!did_hit)
+		return false;
+
+	hit->t = (float) tri_hit.t;
+	hit->triangle = tri_hit.triangle;
+	hit->u = tri_hit.b;
+	hit->v = tri_hit.c;
+	return true;
+}
+
+static bool ray_mesh_occluded(Ray ray, const Mesh *mesh)
+{
+	if (mesh->accel == MESH_BVH)
+		return ray_bvh_occluded(ray, mesh);
+
+	return ray_kd_tree_occluded(ray, mesh);
+}
+
+/* Runs the intersection routine of the surface's shape on a ray that has
+ * already been transformed to model space. */
+static int ray_shape_intersect(Ray tray, const SurfaceRecord *rec, float t[2],
+		int part[2])
+{
+	switch(rec->type)
 	{
 	case SHAPE_PLANE:
-		hits = ray_plane_intersect(tray, shape->u.plane, ts, tnormals);
-		break;
+		return ray_plane_intersect(tray, rec, t, part);
 	case SHAPE_DISK:
-		hits = ray_disk_intersect(tray, shape->u.disk, ts, tnormals);
-		break;
+		return ray_disk_intersect(tray, rec, t, part);
 	case SHAPE_SPHERE:
-		hits = ray_sphere_intersect(tray, shape->u.sphere, ts, tnormals);
-		break;
+		return ray_sphere_intersect(tray, rec, t);
 	case SHAPE_CYLINDER:
-		hits = ray_cylinder_intersect(tray, shape->u.cylinder, ts, tnormals);
-		break;
+		return ray_cylinder_intersect(tray, rec, t, part);
 	case SHAPE_CONE:
-		hits = ray_cone_intersect(tray, shape->u.cone, ts, tnormals);
-		break;
+		return ray_cone_intersect(tray, rec, t);
 	case SHAPE_MESH:
-		hits = ray_mesh_intersect(tray, shape->u.mesh, ts, tnormals);
-		break;
 	default:
 		printf("Unknown shape\n");
-		return false;
-		break;
+		return 0;
+	}
+}
+
+static Vec3 point_to_model(const SurfaceRecord *rec, Vec3 p)
+{
+	const float (*m)[4] = rec->to_model;
+	Vec3 q;
+
+	if (rec->scale_translate)
+	{
+		q.x = m[0][0]*p.x + m[0][3];
+		q.y = m[0][0]*p.y + m[1][3];
+		q.z = m[0][0]*p.z + m[2][3];
+	} else
+	{
+		q.x = m[0][0]*p.x + m[0][1]*p.y + m[0][2]*p.z + m[0][3];
+		q.y = m[1][0]*p.x + m[1][1]*p.y + m[1][2]*p.z + m[1][3];
+		q.z = m[2][0]*p.x + m[2][1]*p.y + m[2][2]*p.z + m[2][3];
 	}
 
+	return q;
+}
+
+static Vec3 direction_to_model(const SurfaceRecord *rec, Vec3 d)
+{
+	const float (*m)[4] = rec->to_model;
+	Vec3 q;
+
+	if (rec->scale_translate)
+		return vec3_scale(m[0][0], d);
+
+	q.x = m[0][0]*d.x + m[0][1]*d.y + m[0][2]*d.z;
+	q.y = m[1][0]*d.x + m[1][1]*d.y + m[1][2]*d.z;
+	q.z = m[2][0]*d.x + m[2][1]*d.y + m[2][2]*d.z;
+
+	return q;
+}
+
+/* The ray in the model space of the surface. Since the direction isn't
+ * normalised, distances along it stay the same. */
+static Ray ray_to_model(Ray ray, const SurfaceRecord *rec)
+{
+	Ray tray;
+
+	tray.origin = point_to_model(rec, ray.origin);
+	tray.direction = direction_to_model(rec, ray.direction);
+	tray.near = ray.near;
+	tray.far = ray.far;
+
+	return tray;
+}
+
+/* Only finds the distance to the closest hit and which part of the shape it
+ * is on. The rest is left to ray_hit_attributes(). */
+static bool ray_surface_intersect(Ray ray, const SurfaceRecord *rec, Hit *hit)
+{
+	float ts[2] = {-HUGE_VAL, -HUGE_VAL};
+	int parts[2] = {0, 0};
+	Ray tray = ray_to_model(ray, rec);
+	int hits, k;
+
+	if (rec->type == SHAPE_MESH)
+		return ray_mesh_intersect(tray, rec->u.mesh, hit);
+
+	hits = ray_shape_intersect(tray, rec, ts, parts);
+
 	/* We're looking for the smallest hit that is between the near and far
 	 * planes of the ray. */
 	if (hits == 0)
@@ -532,51 +1068,120 @@ static bool ray_surface_intersect(Ray ray, const Surface *surf, Hit *hit)
 		if (ts[0] < ray.near || ts[0] > ray.far)
 			return false;
 
-		t = ts[0];
-		tnormal = tnormals[0];
+		k = 0;
 	} else if (hits == 2)
 	{
 		bool t0_ok = ts[0] >= ray.near && ts[0] <= ray.far;
 		bool t1_ok = ts[1] >= ray.near && ts[1] <= ray.far;
 
 		     if (!t0_ok && !t1_ok)
-		{
 			return false;
-		}
 		else if (t0_ok && !t1_ok)
-		{
-			t = ts[0];
-			tnormal = tnormals[0];
-		}
+			k = 0;
 		else if (!t0_ok && t1_ok)
-		{
-			t = ts[1];
-			tnormal = tnormals[1];
-		}
+			k = 1;
 		else
-		{
-			if (ts[0] < ts[1])
-			{
-				t = ts[0];
-				tnormal = tnormals[0];
-			} else
-			{
-				t = ts[1];
-				tnormal = tnormals[1];
-			}
-		}
+			k = ts[0] < ts[1] ? 0 : 1;
 	} else
 	{
 		printf("General t finding code unimplemented\n");
 		return false;
 	}
 
-	hit->t = t;
-	hit->position = vec3_add(ray.origin, vec3_scale(t, ray.direction));
-	hit->normal = vec3_normalize(mat4_transform3_hetero(normal_matrix, tnormal));
+	hit->t = ts[k];
+	hit->part = parts[k];
 	return true;
 }
 
+/* The (unnormalised) normal in model space at the point p of the shape */
+static Vec3 shape_normal(const SurfaceRecord *rec, const Hit *hit, Vec3 p)
+{
+	switch(rec->type)
+	{
+	case SHAPE_PLANE:
+	{
+		const Real *n = rec->u.plane.normal;
+		const float sign = hit->part == PART_FRONT ? 1 : -1;
+
+		return (Vec3) {sign*n[0], sign*n[1], sign*n[2]};
+	}
+	case SHAPE_DISK:
+		return (Vec3) {0, 0, hit->part == PART_FRONT ? 1 : -1};
+	case SHAPE_SPHERE:
+		return p;
+	case SHAPE_CYLINDER:
+		if (hit->part == PART_BOTTOM)
+			return (Vec3) {0, 0, -1};
+		else if (hit->part == PART_TOP)
+			return (Vec3) {0, 0, 1};
+		else
+			return (Vec3) {p.x, p.y, 0};
+	case SHAPE_CONE:
+	{
+		const float rxy = sqrtf(SQUARE(p.x) + SQUARE(p.y));
+
+		return (Vec3) {rec->u.cone.cos*p.x/rxy, rec->u.cone.cos*p.y/rxy,
+				rec->u.cone.sin};
+	}
+	case SHAPE_MESH:
+	{
+		const Mesh *mesh = rec->u.mesh;
+		const int i = hit->triangle;
+		const Vec3 n0 = mesh->normal[MESH_NORMAL_INDEX(mesh, i, 0)];
+		const Vec3 n1 = mesh->normal[MESH_NORMAL_INDEX(mesh, i, 1)];
+		const Vec3 n2 = mesh->normal[MESH_NORMAL_INDEX(mesh, i, 2)];
+		const float a = 1 - hit->u - hit->v;
+
+		return vec3_add(vec3_add(vec3_scale(a, n0), vec3_scale(hit->u, n1)),
+				vec3_scale(hit->v, n2));
+	}
+	default:
+		printf("Unknown shape\n");
+		return (Vec3) {0, 0, 1};
+	}
+}
+
+/* Fill in the position and normal of the closest hit, which the
+ * intersection routines have left alone. */
+static void ray_hit_attributes(Ray ray, Hit *hit)
+{
+	const SurfaceRecord *rec = hit->record;
+	const float (*m)[3] = rec->normal_to_world;
+	Vec3 p, n;
+
+	hit->position = vec3_add(ray.origin, vec3_scale(hit->t, ray.direction));
+
+	p = point_to_model(rec, hit->position);
+	n = shape_normal(rec, hit, p);
+	/* Uniform scales don't change the direction of the normal */
+	if (!rec->scale_translate)
+		n = (Vec3) {
+			m[0][0]*n.x + m[0][1]*n.y + m[0][2]*n.z,
+			m[1][0]*n.x + m[1][1]*n.y + m[1][2]*n.z,
+			m[2][0]*n.x + m[2][1]*n.y + m[2][2]*n.z};
+	hit->normal = vec3_normalize(n);
+}
+
+/* Whether the surface blocks the ray anywhere between its near and far
+ * distances. No normals or hit positions are computed. */
+static bool ray_surface_occluded(Ray ray, const SurfaceRecord *rec)
+{
+	float ts[2] = {-HUGE_VAL, -HUGE_VAL};
+	int parts[2];
+	Ray tray = ray_to_model(ray, rec);
+	int hits;
+
+	if (rec->type == SHAPE_MESH)
+		return ray_mesh_occluded(tray, rec->u.mesh);
+
+	hits = ray_shape_intersect(tray, rec, ts, parts);
+	for (int i = 0; i < hits && i < 2; i++)
+		if (ts[i] >= ray.near && ts[i] <= ray.far)
+			return true;
+
+	return false;
+}
+
 static bool ray_bbox_test(Ray ray, BBox bbox, Ray *bray)
 {
 	float xmin = bbox.xmin, xmax = bbox.xmax;
@@ -642,31 +1247,555 @@ static bool ray_bbox_test(Ray ray, BBox bbox, Ray *bray)
 
 bool ray_intersect(Ray ray, Hit *hit)
 {
+	const Bvh *bvh = scene->bvh;
+	struct { int node; float near; } stack[bvh->depth + 1];
+	int top = 0;
 	Hit test_hit;
-	Surface *surface;
+	Ray bray;
 
 	hit->surface = NULL;
 	hit->t = HUGE_VAL;
 
-	for (surface = scene->root; surface; surface = surface->next)
+	if (bvh->num_nodes == 0 || !ray_bbox_test(ray, bvh->node[0].bbox, &bray))
+		return false;
+
+	stack[top].node = 0;
+	stack[top].near = bray.near;
+	top++;
+	while (top > 0)
 	{
-		Ray bray;
-		/* Test the surface's bounding box and clip the ray if necessary */
-		if (!ray_bbox_test(ray, surface->bbox, &bray))
+		const BvhNode *node;
+
+		/* Everything in this node lies beyond the closest hit so far */
+		top--;
+		if (stack[top].near > ray.far)
 			continue;
+		node = &bvh->node[stack[top].node];
 
-		test_hit.surface = surface;
-		if (ray_surface_intersect(bray, surface, &test_hit))
+		if (node->num_surfaces > 0)
+		{
+			for (int i = 0; i < node->num_surfaces; i++)
+			{
+				const SurfaceRecord *rec = &bvh->record[node->offset + i];
+
+				/* Test the surface's bounding box and clip the ray */
+				if (!ray_bbox_test(ray, rec->bbox, &bray))
+					continue;
+
+				test_hit.surface = rec->surface;
+				test_hit.record = rec;
+				if (ray_surface_intersect(bray, rec, &test_hit))
+				{
+					if (hit->surface == NULL || test_hit.t < hit->t)
+					{
+						*hit = test_hit;
+						/* No need to look any further than this */
+						ray.far = MIN(ray.far, test_hit.t);
+					}
+				}
+			}
+		} else
 		{
-			if (hit->surface == NULL || test_hit.t < hit->t)
+			const int left = node - bvh->node + 1, right = node->offset;
+			Ray lray, rray;
+			bool lhit, rhit;
+
+			lhit = ray_bbox_test(ray, bvh->node[left].bbox, &lray) &&
+					lray.near <= lray.far;
+			rhit = ray_bbox_test(ray, bvh->node[right].bbox, &rray) &&
+					rray.near <= rray.far;
+
+			/* Push the far child first, so the near one is popped next */
+			if (lhit && rhit && lray.near <= rray.near)
+			{
+				stack[top].node = right; stack[top++].near = rray.near;
+				stack[top].node = left;  stack[top++].near = lray.near;
+			} else if (lhit && rhit)
 			{
-				*hit = test_hit;
+				stack[top].node = left;  stack[top++].near = lray.near;
+				stack[top].node = right; stack[top++].near = rray.near;
+			}
+			else if (lhit)
+			{
+				stack[top].node = left;  stack[top++].near = lray.near;
+			}
+			else if (rhit)
+			{
+				stack[top].node = right; stack[top++].near = rray.near;
 			}
 		}
 	}
 
-	if (hit->surface != NULL)
-		return true;
-	else
+	if (hit->surface == NULL)
+		return false;
+
+	ray_hit_attributes(ray, hit);
+	return true;
+}
+
+/* Is there anything at all between the ray's near and far distances? Meant
+ * for shadow rays, which don't care about what they hit, or where. */
+bool ray_occluded(Ray ray)
+{
+	const Bvh *bvh = scene->bvh;
+	int stack[bvh->depth + 1];
+	int top = 0;
+
+	if (bvh->num_nodes == 0)
 		return false;
+
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const BvhNode *node = &bvh->node[stack[--top]];
+		Ray bray;
+
+		if (!ray_bbox_test(ray, node->bbox, &bray) || bray.near > bray.far)
+			continue;
+
+		if (node->num_surfaces > 0)
+		{
+			for (int i = 0; i < node->num_surfaces; i++)
+			{
+				const SurfaceRecord *rec = &bvh->record[node->offset + i];
+
+				if (ray_bbox_test(ray, rec->bbox, &bray) &&
+						ray_surface_occluded(bray, rec))
+					return true;
+			}
+		} else
+		{
+			stack[top++] = node->offset;
+			stack[top++] = node - bvh->node + 1;
+		}
+	}
+
+	return false;
+}
+
+/****************
+ * Ray packets *
+ ****************/
+
+typedef uint32_t RayMask; /* Bit i is set for the rays of a packet still going */
+
+/* Walk the kd-tree with all the rays in the mask at once. Every ray keeps its
+ * own stretch [near, far] inside the current node. With hit == NULL any hit
+ * will do, otherwise the closest one is found. Returns which rays hit. */
+static RayMask ray_kd_packet_traverse(const Ray *ray, int n, RayMask mask,
+		const Mesh *mesh, struct TriangleHit *hit)
+{
+	struct {
+		const KdFlatNode *node;
+		RayMask mask;
+		float near[RAY_PACKET_MAX], far[RAY_PACKET_MAX];
+	} stack[KD_STACK_SIZE];
+	Real origin[RAY_PACKET_MAX][3], inv_dir[RAY_PACKET_MAX][3];
+	float near[RAY_PACKET_MAX], far[RAY_PACKET_MAX];
+	bool positive[3];
+	const KdFlatNode *node = mesh->kd_node;
+	RayMask done = 0;
+	int first = -1, top = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		if (!(mask & 1u << i))
+			continue;
+		if (first < 0)
+		{
+			first = i;
+			positive[0] = ray[i].direction.x > 0;
+			positive[1] = ray[i].direction.y > 0;
+			positive[2] = ray[i].direction.z > 0;
+		}
+
+		/* The rays have to agree on which child comes first. If they
+		 * don't, they're traced one by one after all. */
+		if (positive[0] != (ray[i].direction.x > 0) ||
+				positive[1] != (ray[i].direction.y > 0) ||
+				positive[2] != (ray[i].direction.z > 0))
+		{
+			for (int j = 0; j < n; j++)
+			{
+				if (!(mask & 1u << j))
+					continue;
+				if (hit == NULL ? ray_kd_tree_occluded(ray[j], mesh) :
+						ray_kd_tree_intersect(ray[j], mesh, &hit[j]))
+					done |= 1u << j;
+			}
+			return done;
+		}
+
+		origin[i][0] = ray[i].origin.x;
+		origin[i][1] = ray[i].origin.y;
+		origin[i][2] = ray[i].origin.z;
+		inv_dir[i][0] = 1/ray[i].direction.x;
+		inv_dir[i][1] = 1/ray[i].direction.y;
+		inv_dir[i][2] = 1/ray[i].direction.z;
+		near[i] = ray[i].near;
+		far[i] = ray[i].far;
+	}
+	if (first < 0)
+		return 0;
+
+	for (;;)
+	{
+		const KdFlatNode *children, *node_near, *node_far;
+		unsigned int axis = KD_NODE_AXIS(node);
+		RayMask near_mask = 0, far_mask = 0;
+		Real clip_t[RAY_PACKET_MAX];
+
+		if (axis == KD_LEAF)
+		{
+			if (KD_NODE_FLAGS(node) == KD_UNBUILT)
+			{
+				node = mesh_expand_kd_node(mesh, node);
+				continue;
+			}
+
+			for (int i = 0; i < n; i++)
+			{
+				Ray leaf_ray = ray[i];
+				bool did_hit;
+
+				if (!(mask & 1u << i))
+					continue;
+
+				leaf_ray.near = near[i];
+				leaf_ray.far = far[i];
+				if (hit == NULL)
+					did_hit = ray_kd_leaf_occluded(leaf_ray, mesh, node);
+				else
+					did_hit = ray_kd_leaf_intersect(leaf_ray, mesh, node,
+							&hit[i]);
+				if (did_hit)
+					done |= 1u << i;
+			}
+
+			/* Rays that hit something are finished, like in
+			 * ray_kd_tree_intersect() */
+			do {
+				if (top == 0)
+					return done;
+
+				top--;
+				node = stack[top].node;
+				mask = stack[top].mask & ~done;
+			} while (mask == 0);
+			memcpy(near, stack[top].near, sizeof(near));
+			memcpy(far, stack[top].far, sizeof(far));
+			continue;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			if (!(mask & 1u << i))
+				continue;
+
+			/* Which children the ray passes through. One that only
+			 * sees one of them keeps its stretch for it. */
+			clip_t[i] = (node->u.split - origin[i][axis]) * inv_dir[i][axis];
+			if (clip_t[i] > far[i])
+				near_mask |= 1u << i;
+			else if (clip_t[i] < near[i])
+				far_mask |= 1u << i;
+			else
+			{
+				near_mask |= 1u << i;
+				far_mask |= 1u << i;
+			}
+		}
+
+		children = &mesh->kd_node[KD_NODE_OFFSET(node)];
+		node_near = &children[!positive[axis]];
+		node_far = &children[positive[axis]];
+
+		if (far_mask != 0 && near_mask != 0)
+		{
+			assert(top < KD_STACK_SIZE);
+			stack[top].node = node_far;
+			stack[top].mask = far_mask;
+			for (int i = 0; i < n; i++)
+			{
+				if (!(far_mask & 1u << i))
+					continue;
+
+				if (near_mask & 1u << i)
+				{
+					stack[top].near[i] = clip_t[i];
+					stack[top].far[i] = far[i];
+					far[i] = clip_t[i];
+				} else
+				{
+					stack[top].near[i] = near[i];
+					stack[top].far[i] = far[i];
+				}
+			}
+			top++;
+
+			node = node_near;
+			mask = near_mask;
+		} else if (near_mask != 0)
+			node = node_near;
+		else
+			node = node_far;
+	}
+}
+
+/* Which of the rays in the mask pass through the bounding box, and where */
+static RayMask ray_packet_bbox_test(const Ray *ray, int n, RayMask mask,
+		BBox bbox, Ray *bray)
+{
+	RayMask hits = 0;
+
+	for (int i = 0; i < n; i++)
+		if ((mask & 1u << i) && ray_bbox_test(ray[i], bbox, &bray[i]) &&
+				bray[i].near <= bray[i].far)
+			hits |= 1u << i;
+
+	return hits;
+}
+
+/* Only meshes with a kd-tree are worth tracing as a packet. Everything else
+ * goes ray by ray, and so does a single ray. */
+static RayMask ray_packet_surface_intersect(const Ray *bray, int n,
+		RayMask mask, const SurfaceRecord *rec, Hit *hit)
+{
+	struct TriangleHit tri_hit[RAY_PACKET_MAX];
+	Ray tray[RAY_PACKET_MAX];
+	const Mesh *mesh;
+	RayMask hits = 0;
+
+	if (rec->type != SHAPE_MESH || rec->u.mesh->accel != MESH_KD_TREE ||
+			(mask & (mask - 1)) == 0)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			if (!(mask & 1u << i))
+				continue;
+
+			hit[i].surface = rec->surface;
+			hit[i].record = rec;
+			if (ray_surface_intersect(bray[i], rec, &hit[i]))
+				hits |= 1u << i;
+		}
+		return hits;
+	}
+
+	mesh = rec->u.mesh;
+	for (int i = 0; i < n; i++)
+		if (mask & 1u << i)
+			tray[i] = ray_to_model(bray[i], rec);
+
+	hits = ray_kd_packet_traverse(tray, n, mask, mesh, tri_hit);
+	for (int i = 0; i < n; i++)
+	{
+		if (!(hits & 1u << i))
+			continue;
+
+		hit[i].surface = rec->surface;
+		hit[i].record = rec;
+		hit[i].t = (float) tri_hit[i].t;
+		hit[i].triangle = tri_hit[i].triangle;
+		hit[i].u = tri_hit[i].b;
+		hit[i].v = tri_hit[i].c;
+	}
+#ifndef NDEBUG
+	for (int i = 0; i < n; i++)
+	{
+		struct TriangleHit single_hit;
+		bool did_hit;
+
+		if (!(mask & 1u << i))
+			continue;
+
+		did_hit = ray_kd_tree_intersect(tray[i], mesh, &single_hit);
+		assert(did_hit == !!(hits & 1u << i));
+		assert(!did_hit || single_hit.t == tri_hit[i].t);
+	}
+#endif
+
+	return hits;
+}
+
+static RayMask ray_packet_surface_occluded(const Ray *bray, int n,
+		RayMask mask, const SurfaceRecord *rec)
+{
+	Ray tray[RAY_PACKET_MAX];
+	RayMask hits = 0;
+
+	if (rec->type != SHAPE_MESH || rec->u.mesh->accel != MESH_KD_TREE ||
+			(mask & (mask - 1)) == 0)
+	{
+		for (int i = 0; i < n; i++)
+			if ((mask & 1u << i) && ray_surface_occluded(bray[i], rec))
+				hits |= 1u << i;
+		return hits;
+	}
+
+	for (int i = 0; i < n; i++)
+		if (mask & 1u << i)
+			tray[i] = ray_to_model(bray[i], rec);
+
+	return ray_kd_packet_traverse(tray, n, mask, rec->u.mesh, NULL);
+}
+
+void ray_packet_intersect(const Ray *ray, int n, Hit *hit)
+{
+	const Bvh *bvh = scene->bvh;
+	struct { int node; RayMask mask; } stack[bvh->depth + 1];
+	Ray clipped[RAY_PACKET_MAX], bray[RAY_PACKET_MAX];
+	Hit test_hit[RAY_PACKET_MAX];
+	RayMask mask;
+	int top = 0;
+
+	assert(n <= RAY_PACKET_MAX);
+	for (int i = 0; i < n; i++)
+	{
+		hit[i].surface = NULL;
+		hit[i].t = HUGE_VAL;
+		/* The far distances shrink as hits are found */
+		clipped[i] = ray[i];
+	}
+
+	if (bvh->num_nodes == 0)
+		return;
+	mask = ray_packet_bbox_test(clipped, n, (1u << n) - 1, bvh->node[0].bbox,
+			bray);
+	if (mask == 0)
+		return;
+
+	stack[top].node = 0;
+	stack[top].mask = mask;
+	top++;
+	while (top > 0)
+	{
+		const BvhNode *node;
+
+		top--;
+		node = &bvh->node[stack[top].node];
+		mask = stack[top].mask;
+
+		if (node->num_surfaces > 0)
+		{
+			for (int k = 0; k < node->num_surfaces; k++)
+			{
+				const SurfaceRecord *rec = &bvh->record[node->offset + k];
+				RayMask hits;
+
+				hits = ray_packet_bbox_test(clipped, n, mask, rec->bbox, bray);
+				if (hits == 0)
+					continue;
+
+				hits = ray_packet_surface_intersect(bray, n, hits, rec,
+						test_hit);
+				for (int i = 0; i < n; i++)
+				{
+					if (!(hits & 1u << i))
+						continue;
+
+					if (hit[i].surface == NULL || test_hit[i].t < hit[i].t)
+					{
+						hit[i] = test_hit[i];
+						clipped[i].far = MIN(clipped[i].far, test_hit[i].t);
+					}
+				}
+			}
+		} else
+		{
+			const int left = node - bvh->node + 1, right = node->offset;
+			RayMask lmask, rmask;
+			float lnear = HUGE_VAL, rnear = HUGE_VAL;
+
+			lmask = ray_packet_bbox_test(clipped, n, mask,
+					bvh->node[left].bbox, bray);
+			for (int i = 0; i < n; i++)
+				if (lmask & 1u << i)
+					lnear = MIN(lnear, bray[i].near);
+			rmask = ray_packet_bbox_test(clipped, n, mask,
+					bvh->node[right].bbox, bray);
+			for (int i = 0; i < n; i++)
+				if (rmask & 1u << i)
+					rnear = MIN(rnear, bray[i].near);
+
+			/* Push the far child first, so the near one is popped next */
+			if (lnear <= rnear)
+			{
+				if (rmask != 0)
+				{
+					stack[top].node = right; stack[top++].mask = rmask;
+				}
+				if (lmask != 0)
+				{
+					stack[top].node = left;  stack[top++].mask = lmask;
+				}
+			} else
+			{
+				if (lmask != 0)
+				{
+					stack[top].node = left;  stack[top++].mask = lmask;
+				}
+				if (rmask != 0)
+				{
+					stack[top].node = right; stack[top++].mask = rmask;
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < n; i++)
+		if (hit[i].surface != NULL)
+			ray_hit_attributes(ray[i], &hit[i]);
+}
+
+void ray_packet_occluded(const Ray *ray, int n, bool *occluded)
+{
+	const Bvh *bvh = scene->bvh;
+	struct { int node; RayMask mask; } stack[bvh->depth + 1];
+	Ray bray[RAY_PACKET_MAX];
+	RayMask blocked = 0;
+	int top = 0;
+
+	assert(n <= RAY_PACKET_MAX);
+	if (bvh->num_nodes > 0)
+	{
+		stack[top].node = 0;
+		stack[top].mask = (1u << n) - 1;
+		top++;
+	}
+	while (top > 0)
+	{
+		const BvhNode *node = &bvh->node[stack[--top].node];
+		RayMask mask = stack[top].mask & ~blocked;
+
+		mask = ray_packet_bbox_test(ray, n, mask, node->bbox, bray);
+		if (mask == 0)
+			continue;
+
+		if (node->num_surfaces > 0)
+		{
+			for (int k = 0; k < node->num_surfaces && mask != 0; k++)
+			{
+				const SurfaceRecord *rec = &bvh->record[node->offset + k];
+				RayMask hits;
+
+				hits = ray_packet_bbox_test(ray, n, mask, rec->bbox, bray);
+				if (hits == 0)
+					continue;
+
+				hits = ray_packet_surface_occluded(bray, n, hits, rec);
+				blocked |= hits;
+				mask &= ~hits;
+			}
+		} else
+		{
+			stack[top].node = node->offset;
+			stack[top++].mask = mask;
+			stack[top].node = node - bvh->node + 1;
+			stack[top++].mask = mask;
+		}
+	}
+
+	for (int i = 0; i < n; i++)
+		occluded[i] = blocked & 1u << i;
 }
@@ -3,6 +3,7 @@
 
 #include "scene.h"
 #include "cgmath.h"
+#include "rng.h"
 
 typedef struct Ray {
 	Vec3 origin;
@@ -13,14 +14,33 @@ typedef struct Ray {
 
 typedef struct Hit {
 	Surface *surface;
+	const SurfaceRecord *record; /* The compiled form of the surface */
 	Vec3 position;
 	Vec3 normal;
-	double t; /* Parameter of the ray equation: v = o + t*d */
+	Real t; /* Parameter of the ray equation: v = o + t*d */
+	/* What the intersection routines record; the position and normal are
+	 * only derived from this for the closest hit. */
+	int part; /* Of the shape, like a cylinder's cap */
+	uint32_t triangle; /* Of a mesh */
+	float u, v; /* Barycentric coordinates on that triangle */
 } Hit;
 
 
-double drand(void); /* TODO FIXME XXX THIS DOESN'T BELONG HERE */
-Ray camera_ray_aa(Camera *cam, int i, int j, int sample, double near);
+Ray camera_ray_stratified(Camera *cam, int i, int j, int sample, int n,
+		double near, Rng *rng);
+Ray camera_ray_aa(Camera *cam, int i, int j, int sample, double near,
+		Rng *rng);
 Ray camera_ray(Camera *cam, int i, int j, double near);
 bool ray_intersect(Ray ray, Hit *hit);
+bool ray_occluded(Ray ray);
+bool ray_mesh_intersect(Ray ray, const Mesh *mesh, Hit *hit);
+
+/* Packets of up to RAY_PACKET_MAX rays, like those through a 4x4 block of
+ * pixels or from there to a point light, are traced together. The rays share
+ * every node they visit and only go their own way where they diverge. They
+ * give the same results as tracing them one by one. */
+enum { RAY_PACKET_MAX = 16 };
+
+void ray_packet_intersect(const Ray *ray, int n, Hit *hit);
+void ray_packet_occluded(const Ray *ray, int n, bool *occluded);
 #endif
@@ -1,13 +1,18 @@
+#define _POSIX_C_SOURCE 200112L
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "colour.h"
 #include "ray.h"
 #include "shading.h"
 #include "ppm.h"
+#include "snapshot.h"
 #include "timer.h"
 
 static void print_progressbar(int progress, int total)
@@ -34,55 +39,517 @@ static Colour pixel_colour(int x, int y)
 	Camera *cam = scene->camera;
 	Colour c;
 	Ray r;
+	Rng rng;
 
 	if (config->antialiasing)
 	{
 		c = BLACK;
 		for (int k = 0; k < SQUARE(config->aa_samples); k++)
 		{
-			r = camera_ray_aa(cam, x, y, k, cam->near_plane);
-			c = colour_add(c, ray_colour(r, 0));
+			rng = rng_pixel(x, y, k);
+			r = camera_ray_aa(cam, x, y, k, cam->near_plane, &rng);
+			c = colour_add(c, ray_colour(r, 0, &rng));
 		}
 		c = colour_scale(1.0/SQUARE(config->aa_samples), c);
 	} else
 	{
+		rng = rng_pixel(x, y, 0);
 		r = camera_ray(cam, x, y, 1);
-		c = ray_colour(r, 0);
+		c = ray_colour(r, 0, &rng);
 	}
 
 	return c;
 }
+
+/* pixel_colour() for a block of pixels that fits in a ray packet. Every
+ * sample is traced for all the pixels together. */
+enum { PACKET_SIZE = 4 };
+
+static void packet_colours(Colour *buffer, int width, int x0, int y0,
+		int x1, int y1)
+{
+	Camera *cam = scene->camera;
+	Ray r[RAY_PACKET_MAX];
+	Rng rng[RAY_PACKET_MAX];
+	Colour c[RAY_PACKET_MAX], total[RAY_PACKET_MAX];
+	const int samples = config->antialiasing ? SQUARE(config->aa_samples) : 1;
+	int n = 0;
+
+	for (int m = 0; m < RAY_PACKET_MAX; m++)
+		total[m] = BLACK;
+	for (int k = 0; k < samples; k++)
+	{
+		n = 0;
+		for (int j = y0; j < y1; j++)
+			for (int i = x0; i < x1; i++, n++)
+			{
+				rng[n] = rng_pixel(i, j, config->antialiasing ? k : 0);
+				if (config->antialiasing)
+					r[n] = camera_ray_aa(cam, i, j, k, cam->near_plane, &rng[n]);
+				else
+					r[n] = camera_ray(cam, i, j, 1);
+			}
+
+		ray_packet_colour(r, n, c, rng);
+		for (int m = 0; m < n; m++)
+			total[m] = colour_add(total[m], c[m]);
+	}
+
+	n = 0;
+	for (int j = y0; j < y1; j++)
+		for (int i = x0; i < x1; i++, n++)
+			buffer[width*j + i] = config->antialiasing ?
+					colour_scale(1.0/samples, total[n]) : c[n];
+}
+
+/************************
+ * Progressive sampling *
+ ************************/
+
+/* In progressive mode every pixel takes a stratified batch of samples per pass,
+ * and keeps going until the standard error of its mean luminance drops below
+ * the threshold or it hits the sample cap. */
+enum { PASS_GRID = 2, PASS_SAMPLES = SQUARE(PASS_GRID) };
+enum { MIN_SAMPLES = 2*PASS_SAMPLES };
+
+typedef struct Progressive {
+	double threshold;
+	int max_samples;
+} Progressive;
+
+typedef struct PixelStats {
+	Colour sum;
+	double lum_sum, lum_sq_sum;
+	int samples;
+	bool converged;
+} PixelStats;
+
+static float luminance(Colour c)
+{
+	return 0.2126f*c.r + 0.7152f*c.g + 0.0722f*c.b;
+}
+
+static void pixel_sample_pass(PixelStats *stats, int x, int y,
+		const Progressive *prog)
+{
+	Camera *cam = scene->camera;
+	double mean, variance;
+	int n;
+
+	if (stats->converged)
+		return;
+
+	for (int k = 0; k < PASS_SAMPLES && stats->samples < prog->max_samples; k++)
+	{
+		Rng rng = rng_pixel(x, y, stats->samples);
+		Ray r = camera_ray_stratified(cam, x, y, k, PASS_GRID,
+				cam->near_plane, &rng);
+		Colour c = ray_colour(r, 0, &rng);
+		float lum = luminance(c);
+
+		stats->sum = colour_add(stats->sum, c);
+		stats->lum_sum += lum;
+		stats->lum_sq_sum += lum*lum;
+		stats->samples++;
+	}
+
+	n = stats->samples;
+	if (n >= prog->max_samples)
+	{
+		stats->converged = true;
+		return;
+	}
+	if (n < MIN_SAMPLES)
+		return;
+
+	mean = stats->lum_sum/n;
+	variance = MAX(0, (stats->lum_sq_sum - n*mean*mean)/(n - 1));
+	if (variance/n < SQUARE(prog->threshold))
+		stats->converged = true;
+}
+
+/******************
+ * Tile rendering *
+ ******************/
+
+enum { TILE_SIZE = 16 };
+
+/* Every worker owns a contiguous range [head, tail) of tile numbers. It takes
+ * work from the head of its own range and, once that runs dry, steals from
+ * the tail of somebody else's. */
+typedef struct TileQueue {
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+} TileQueue;
+
+typedef struct RenderJob {
+	Colour *buffer;
+	PixelStats *stats; /* Only in progressive mode, instead of the buffer */
+	const Progressive *prog;
+	bool packets;
+	bool wavefront;
+	int width, height;
+	int tiles_x, tiles_y;
+	int num_workers;
+	TileQueue *queue;
+	pthread_mutex_t progress_lock;
+	int tiles_done;
+} RenderJob;
+
+typedef struct Worker {
+	RenderJob *job;
+	int id;
+	pthread_t thread;
+} Worker;
+
+static bool tile_pop(TileQueue *queue, bool steal, int *tile)
+{
+	bool ok = false;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head < queue->tail)
+	{
+		*tile = steal ? --queue->tail : queue->head++;
+		ok = true;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return ok;
+}
+
+static bool tile_next(RenderJob *job, int id, int *tile)
+{
+	if (tile_pop(&job->queue[id], false, tile))
+		return true;
+
+	for (int i = 1; i < job->num_workers; i++)
+		if (tile_pop(&job->queue[(id + i) % job->num_workers], true, tile))
+			return true;
+
+	return false;
+}
+
+/* All samples of all pixels of the tile go through the wavefront integrator
+ * at once. They are averaged the way pixel_colour() does it. */
+static void render_tile_wavefront(RenderJob *job, int x0, int y0, int x1,
+		int y1)
+{
+	Camera *cam = scene->camera;
+	const int samples = config->antialiasing ? SQUARE(config->aa_samples) : 1;
+	Ray *ray;
+	Rng *rng;
+	Colour *c;
+	int n = 0;
+
+	ray = malloc(TILE_SIZE*TILE_SIZE*samples*sizeof(Ray));
+	rng = malloc(TILE_SIZE*TILE_SIZE*samples*sizeof(Rng));
+	c = malloc(TILE_SIZE*TILE_SIZE*samples*sizeof(Colour));
+	for (int j = y0; j < y1; j++)
+		for (int i = x0; i < x1; i++)
+			for (int k = 0; k < samples; k++, n++)
+			{
+				if (config->antialiasing)
+				{
+					rng[n] = rng_pixel(i, j, k);
+					ray[n] = camera_ray_aa(cam, i, j, k, cam->near_plane,
+							&rng[n]);
+				} else
+				{
+					rng[n] = rng_pixel(i, j, 0);
+					ray[n] = camera_ray(cam, i, j, 1);
+				}
+			}
+
+	ray_colour_wavefront(ray, n, c, rng);
+
+	n = 0;
+	for (int j = y0; j < y1; j++)
+		for (int i = x0; i < x1; i++)
+		{
+			Colour total;
+
+			if (config->antialiasing)
+			{
+				total = BLACK;
+				for (int k = 0; k < samples; k++)
+					total = colour_add(total, c[n++]);
+				total = colour_scale(1.0/samples, total);
+			} else
+				total = c[n++];
+			job->buffer[job->width*j + i] = total;
+		}
+
+	free(ray);
+	free(rng);
+	free(c);
+}
+
+static void render_tile(RenderJob *job, int tile)
+{
+	const int x0 = (tile % job->tiles_x) * TILE_SIZE;
+	const int y0 = (tile / job->tiles_x) * TILE_SIZE;
+	const int x1 = MIN(x0 + TILE_SIZE, job->width);
+	const int y1 = MIN(y0 + TILE_SIZE, job->height);
+
+	if (job->stats != NULL)
+	{
+		for (int j = y0; j < y1; j++)
+			for (int i = x0; i < x1; i++)
+				pixel_sample_pass(&job->stats[job->width*j + i], i, j,
+						job->prog);
+		return;
+	}
+
+	if (job->wavefront)
+	{
+		render_tile_wavefront(job, x0, y0, x1, y1);
+		return;
+	}
+
+	if (job->packets)
+	{
+		for (int j = y0; j < y1; j += PACKET_SIZE)
+			for (int i = x0; i < x1; i += PACKET_SIZE)
+				packet_colours(job->buffer, job->width, i, j,
+						MIN(i + PACKET_SIZE, x1), MIN(j + PACKET_SIZE, y1));
+		return;
+	}
+
+	for (int j = y0; j < y1; j++)
+		for (int i = x0; i < x1; i++)
+			job->buffer[job->width*j + i] = pixel_colour(i, j);
+}
+
+static void *render_worker(void *data)
+{
+	Worker *worker = (Worker *) data;
+	RenderJob *job = worker->job;
+	const int num_tiles = job->tiles_x * job->tiles_y;
+	int tile;
+
+	while (tile_next(job, worker->id, &tile))
+	{
+		render_tile(job, tile);
+
+		pthread_mutex_lock(&job->progress_lock);
+		job->tiles_done++;
+		print_progressbar(job->tiles_done, num_tiles);
+		pthread_mutex_unlock(&job->progress_lock);
+	}
+
+	return NULL;
+}
+
+/* Runs over every tile of the job once */
+static void render_pass(RenderJob *job)
+{
+	Worker *workers;
+	const int num_workers = job->num_workers;
+	int num_tiles;
+
+	job->tiles_done = 0;
+	num_tiles = job->tiles_x * job->tiles_y;
+
+	job->queue = calloc(num_workers, sizeof(TileQueue));
+	workers = calloc(num_workers, sizeof(Worker));
+	pthread_mutex_init(&job->progress_lock, NULL);
+	for (int i = 0; i < num_workers; i++)
+	{
+		pthread_mutex_init(&job->queue[i].lock, NULL);
+		job->queue[i].head = (long) num_tiles * i / num_workers;
+		job->queue[i].tail = (long) num_tiles * (i + 1) / num_workers;
+		workers[i].job = job;
+		workers[i].id = i;
+	}
+
+	/* The main thread doubles as worker 0 */
+	for (int i = 1; i < num_workers; i++)
+		pthread_create(&workers[i].thread, NULL, render_worker, &workers[i]);
+	render_worker(&workers[0]);
+	for (int i = 1; i < num_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (int i = 0; i < num_workers; i++)
+		pthread_mutex_destroy(&job->queue[i].lock);
+	pthread_mutex_destroy(&job->progress_lock);
+	free(workers);
+	free(job->queue);
+}
+
+/* With prog == NULL every pixel takes the fixed number of samples from the
+ * config in a single pass, traced as packets or as wavefronts if asked for.
+ * Otherwise passes are rendered until all pixels have converged. */
+static void render(Colour *buffer, int width, int height, int num_workers,
+		const Progressive *prog, bool packets, bool wavefront)
+{
+	RenderJob job;
+	long total_samples;
+	int pass, active;
+
+	job.buffer = buffer;
+	job.stats = NULL;
+	job.prog = prog;
+	job.packets = packets;
+	job.wavefront = wavefront;
+	job.width = width;
+	job.height = height;
+	job.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	job.tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+	job.num_workers = num_workers;
+
+	if (prog == NULL)
+	{
+		render_pass(&job);
+		printf("\n");
+		return;
+	}
+
+	job.stats = calloc(width*height, sizeof(PixelStats));
+	active = width*height;
+	for (pass = 0; active > 0; pass++)
+	{
+		render_pass(&job);
+
+		active = 0;
+		for (int i = 0; i < width*height; i++)
+			if (!job.stats[i].converged)
+				active++;
+		printf("\nPass %d: %d pixels left\n", pass + 1, active);
+	}
+
+	total_samples = 0;
+	for (int i = 0; i < width*height; i++)
+	{
+		PixelStats *stats = &job.stats[i];
+
+		buffer[i] = colour_scale(1.0/stats->samples, stats->sum);
+		total_samples += stats->samples;
+	}
+	printf("%.2f samples per pixel on average\n",
+			total_samples/(double) (width*height));
+	free(job.stats);
+}
+
+/* How many nodes of each lazily built kd-tree rendering needed, compared to
+ * the whole tree, which is finished to find out */
+static void report_lazy_kd_trees(Sdl *sdl)
+{
+	for (int i = 0; i < sdl->num_shapes; i++)
+	{
+		Mesh *mesh = sdl->shape[i].u.mesh;
+		int built = 0;
+
+		if (sdl->shape[i].type != SHAPE_MESH || mesh->kd_lazy == NULL)
+			continue;
+		for (int j = 0; j < mesh->num_kd_nodes; j++)
+			if (mesh->kd_node[j].flags != KD_UNBUILT)
+				built++;
+		mesh_finish_kd_tree(mesh);
+		printf("Built %d of %d kd-tree nodes of %s on demand (%.1f%%)\n",
+				built, mesh->num_kd_nodes, mesh->name,
+				100.0 * built / MAX(mesh->num_kd_nodes, 1));
+	}
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [--threads N] [--packets | --wavefront | --progressive "
+			"[--threshold E] [--max-samples N]] [--compile-scene out.sdlc] "
+			"[--report] scene.sdl\n", name);
+}
+
 int main(int argc, char **argv)
 {
-	Timer *render_timer;
+	Timer *render_timer, *startup_timer;
 	Sdl *sdl;
 	FILE *out;
 	Colour *buffer;
-	int width, height;
+	const char *filename = NULL, *compile_to = NULL;
+	int width, height, num_threads;
+	Progressive prog = {0.01, 0};
+	bool progressive = false, packets = false, wavefront = false;
+	bool prog_options = false, report = false;
 
-	if (argc < 2)
+	startup_timer = timer_start("Starting up");
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			num_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--packets") == 0)
+			packets = true;
+		else if (strcmp(argv[i], "--wavefront") == 0)
+			wavefront = true;
+		else if (strcmp(argv[i], "--progressive") == 0)
+			progressive = true;
+		else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+		{
+			prog.threshold = atof(argv[++i]);
+			prog_options = true;
+		} else if (strcmp(argv[i], "--max-samples") == 0 && i + 1 < argc)
+		{
+			prog.max_samples = atoi(argv[++i]);
+			prog_options = true;
+		} else if (strcmp(argv[i], "--compile-scene") == 0 && i + 1 < argc)
+			compile_to = argv[++i];
+		else if (strcmp(argv[i], "--report") == 0)
+			report = true;
+		else if (argv[i][0] != '-' && filename == NULL)
+			filename = argv[i];
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (filename == NULL)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	/* The three ways of rendering don't mix */
+	if (packets + wavefront + progressive > 1)
+	{
+		printf("Only one of --packets, --wavefront and --progressive can be "
+				"given\n");
 		return 1;
+	}
+	if (prog_options && !progressive)
+	{
+		printf("--threshold and --max-samples need --progressive\n");
+		return 1;
+	}
+	if (num_threads < 1)
+		num_threads = 1;
 
-	sdl = sdl_load(argv[1]);
+	sdl = sdl_load(filename);
 	if (sdl == NULL)
 		return 1;
+	if (compile_to != NULL)
+		return sdl_compile(sdl, compile_to) ? 0 : 1;
+
+	/* By default a pixel may take up to four times what it would get from
+	 * the regular antialiasing */
+	if (prog.max_samples <= 0)
+		prog.max_samples = 4*SQUARE(config->antialiasing ?
+				config->aa_samples : 1);
+	prog.max_samples = MAX(prog.max_samples, MIN_SAMPLES);
 
 	width = config->width;
 	height = config->height;
 	buffer = calloc(width*height, sizeof(Colour));
 
-	srand(0x20071208);
+	timer_stop(startup_timer);
+	printf("Time to first ray: %.3f msec\n", timer_diff(startup_timer) * 1000);
+	free(startup_timer);
+	printf("Rendering with %d thread%s\n", num_threads,
+			num_threads == 1 ? "" : "s");
 	/* START */
 	render_timer = timer_start("Rendering");
 
-	for (int j = 0; j < height; j++)
-	{
-		for (int i = 0; i < width; i++)
-			buffer[width*j + i] = pixel_colour(i, j);
-
-		print_progressbar(j, height - 1);
-	}
-	printf("\n");
+	render(buffer, width, height, num_threads, progressive ? &prog : NULL,
+			packets, wavefront);
 
 	/* STOP */
 
@@ -90,6 +557,8 @@ int main(int argc, char **argv)
 	timer_diff_print(render_timer);
 	printf("%.2f kilopixels per second\n",
 			width*height/1000./(timer_diff(render_timer)));
+	if (report)
+		report_lazy_kd_trees(sdl);
 	out = fopen("ray.ppm", "w");
 	ppm_write(buffer, width, height, out);
 	free(buffer);
@@ -120,7 +120,6 @@ int main(int argc, char **argv)
 	}
 	srand(time(NULL));
 	shuffle_pixels(pixels, config->width, config->height);
-	srand(0x20071208);
 
 	/* START */
 	render_timer = timer_start("Rendering");
@@ -130,13 +129,15 @@ int main(int argc, char **argv)
 		Camera *cam = scene->camera;
 		Colour c;
 		Ray r;
+		Rng rng;
 		int x = pixels[i].x, y = pixels[i].y;
 
 		/* The last parameter is the near plane, which is irrelevant for
 		 * the moment. */
 		r = camera_ray(cam, x, y, 1);
 
-		c = ray_colour(r, 0);
+		rng = rng_pixel(x, y, 0);
+		c = ray_colour(r, 0, &rng);
 
 		buffer[config->width*y + x] = c;
 		put_pixel(display_surface, x, y, c);
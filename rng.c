@@ -0,0 +1,50 @@
+#include <stdint.h>
+
+#include "rng.h"
+
+/* Chris Wellons' lowbias32 integer finalizer */
+static uint32_t hash32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+
+	return x;
+}
+
+static uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+	return hash32(seed ^ (v + 0x9e3779b9 + (seed << 6) + (seed >> 2)));
+}
+
+/* The stream for sample number 'sample' of pixel (x, y) */
+Rng rng_pixel(int x, int y, int sample)
+{
+	Rng rng;
+
+	rng.key = hash_combine(hash_combine(hash32(x), y), sample);
+	rng.dimension = 0;
+
+	return rng;
+}
+
+/* An independent stream for the index'th ray spawned at a given bounce */
+Rng rng_branch(const Rng *rng, int bounce, int index)
+{
+	Rng child;
+
+	child.key = hash_combine(hash_combine(rng->key, bounce), index);
+	child.dimension = 0;
+
+	return child;
+}
+
+/* Uniformly distributed in [0, 1) */
+double rng_double(Rng *rng)
+{
+	uint32_t bits = hash_combine(rng->key, rng->dimension++);
+
+	return (bits >> 8)/((double) (1 << 24));
+}
@@ -0,0 +1,19 @@
+#ifndef CG_RNG_H
+#define CG_RNG_H
+
+#include <stdint.h>
+
+/* A counter-based random number generator. Every number is a hash of the
+ * stream's key and the number of values drawn from it so far (the dimension),
+ * so a pixel sample produces the same numbers no matter which thread renders
+ * it or in which order. */
+typedef struct Rng {
+	uint32_t key;
+	uint32_t dimension;
+} Rng;
+
+Rng rng_pixel(int x, int y, int sample);
+Rng rng_branch(const Rng *rng, int bounce, int index);
+double rng_double(Rng *rng);
+
+#endif
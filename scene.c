@@ -10,6 +10,7 @@
 
 #include "timer.h"
 #include "scene.h"
+#include "snapshot.h"
 
 static Config internal_config;
 
@@ -85,6 +86,26 @@ static bool import_config(xmlNode *node)
 	internal_config.reflection_samples = parse_int(xmlGetProp(node, "reflection_samples"));
 	internal_config.max_reflections = parse_int(xmlGetProp(node, "max_reflections"));
 	internal_config.depth_of_field = parse_bool(xmlGetProp(node, "depth_of_field"));
+	internal_config.kd.traversal_cost = parse_double(xmlGetProp(node, "kd_traversal_cost"));
+	internal_config.kd.intersect_cost = parse_double(xmlGetProp(node, "kd_intersect_cost"));
+	internal_config.kd.empty_bonus = parse_double(xmlGetProp(node, "kd_empty_bonus"));
+	internal_config.kd.max_depth = parse_int(xmlGetProp(node, "kd_max_depth"));
+
+	/* Anything else makes splitting off empty space free, and every node
+	 * is split down to the maximum depth */
+	if (!(internal_config.kd.traversal_cost > 0) ||
+			!(internal_config.kd.intersect_cost > 0))
+	{
+		printf("kd_traversal_cost and kd_intersect_cost have to be "
+				"positive\n");
+		return false;
+	}
+	if (!(internal_config.kd.empty_bonus >= 0 &&
+			internal_config.kd.empty_bonus < 1))
+	{
+		printf("kd_empty_bonus has to be at least 0 and less than 1\n");
+		return false;
+	}
 
 	config = &internal_config;
 	return true;
@@ -223,6 +244,16 @@ static bool import_shapes(Sdl *sdl, xmlNode *node, int n)
 			return false;
 		}
 		shape->name = strdup(xmlGetProp(cur_node, "name"));
+		if (shape->type == SHAPE_MESH)
+		{
+			shape->u.mesh->name = shape->name;
+			if (parse_bool(xmlGetProp(cur_node, "optimise")))
+				mesh_optimise(shape->u.mesh);
+			shape->u.mesh->lazy_kd_tree =
+					parse_bool(xmlGetProp(cur_node, "lazy"));
+			if (strcmp(xmlGetProp(cur_node, "accel"), "bvh") == 0)
+				shape->u.mesh->accel = MESH_BVH;
+		}
 
 	}
 	assert(i == n);
@@ -338,7 +369,7 @@ static bool import_graph(Sdl *sdl, Surface **root, xmlNode *xml_node,
 	{
 		const char *shape_name, *material_name;
 		Surface *surf;
-		surf = calloc(1, sizeof(Surface));
+		surf = arena_calloc(&sdl->arena, 1, sizeof(Surface));
 		surf->next = *root;
 		*root = surf;
 		shape_name = xmlGetProp(xml_node, "geometry");
@@ -577,7 +608,7 @@ static bool import_scene(Sdl *sdl, xmlNode *node, int n)
 		rw_scene->environment_map = NULL;
 
 	/* The actual scene */
-	model_matrix = matstack_new();
+	model_matrix = matstack_new(&sdl->arena);
 	matstack_push(model_matrix);
 	mat4_identity(model_matrix->top->matrix);
 	mat4_identity(model_matrix->top->inverse);
@@ -587,10 +618,8 @@ static bool import_scene(Sdl *sdl, xmlNode *node, int n)
 			model_matrix))
 	{
 		printf("Error importing the scene graph\n");
-		matstack_destroy(model_matrix);
 		return false;
 	}
-	matstack_destroy(model_matrix);
 
 	scene = &sdl->internal_scene;
 	return true;
@@ -599,6 +628,9 @@ static bool import_scene(Sdl *sdl, xmlNode *node, int n)
 static bool import_sdl(Sdl *sdl, xmlDoc *doc)
 {
 	xmlNode *root, *node;
+	Timer *kd_timer, *bvh_timer;
+	Mesh **meshes;
+	int num_meshes;
 
 	root = xmlDocGetRootElement(doc);
 	if (root == NULL)
@@ -651,22 +683,55 @@ static bool import_sdl(Sdl *sdl, xmlDoc *doc)
 		}
 	}
 
-	/* Build bounding boxes and kd-trees */
+	/* Build bounding boxes and gather the meshes that need a kd-tree or BVH */
+	meshes = calloc(sdl->num_shapes, sizeof(Mesh *));
+	num_meshes = 0;
 	for (Surface *surf = sdl->internal_scene.root; surf; surf = surf->next)
 	{
+		const Mesh *mesh = surf->shape->u.mesh;
+
 		build_bbox(surf);
 
-		if (surf->shape->type == SHAPE_MESH && surf->shape->u.mesh->kd_tree == NULL)
+		if (surf->shape->type == SHAPE_MESH && (mesh->accel == MESH_BVH ?
+				mesh->bvh_node == NULL : mesh->kd_node == NULL))
+		{
+			bool seen = false;
+			for (int i = 0; i < num_meshes; i++)
+				if (meshes[i] == surf->shape->u.mesh)
+					seen = true;
+			if (!seen)
+				meshes[num_meshes++] = surf->shape->u.mesh;
+		}
+	}
+
+	if (num_meshes > 0)
+	{
+		Timer **mesh_timers;
+
+		printf("Building %d mesh tree%s\n", num_meshes,
+				num_meshes == 1 ? "" : "s");
+		mesh_timers = calloc(num_meshes, sizeof(Timer *));
+		kd_timer = timer_start("Building mesh trees");
+		mesh_build_trees(meshes, mesh_timers, num_meshes, &config->kd);
+		timer_stop(kd_timer);
+		for (int i = 0; i < num_meshes; i++)
 		{
-			Timer *kd_timer;
-			printf("Building kd-tree for %s\n", surf->shape->name);
-			kd_timer = timer_start("Building kd-tree");
-			mesh_build_kd_tree(surf->shape->u.mesh);
-			timer_stop(kd_timer);
-			timer_diff_print(kd_timer);
-			free(kd_timer);
+			printf("Building %s for ", meshes[i]->accel == MESH_BVH ?
+					"BVH" : "kd-tree");
+			timer_diff_print(mesh_timers[i]);
+			free(mesh_timers[i]);
 		}
+		timer_diff_print(kd_timer);
+		free(kd_timer);
+		free(mesh_timers);
 	}
+	free(meshes);
+
+	bvh_timer = timer_start("Building BVH");
+	sdl->internal_scene.bvh = bvh_build(sdl->internal_scene.root);
+	timer_stop(bvh_timer);
+	timer_diff_print(bvh_timer);
+	free(bvh_timer);
 
 	return true;
 }
@@ -676,7 +741,10 @@ Sdl *sdl_load(const char *filename)
 	Sdl *sdl = NULL;
 	xmlDoc *doc = NULL;
 
-	sdl = malloc(sizeof(Sdl));
+	if (sdl_is_compiled(filename))
+		return sdl_load_compiled(filename);
+
+	sdl = calloc(1, sizeof(Sdl));
 
 	LIBXML_TEST_VERSION
 
@@ -697,6 +765,7 @@ Sdl *sdl_load(const char *filename)
 	xmlCleanupParser();
 	return sdl;
 errorout:
+	arena_free(&sdl->arena);
 	free(sdl);
 	if (doc) xmlFreeDoc(doc);
 	xmlCleanupParser();
@@ -5,6 +5,7 @@
 #include "colour.h"
 #include "texture.h"
 #include "mesh.h"
+#include "bvh.h"
 #include "lighting.h"
 
 enum { MAX_LIGHTS=8 };
@@ -73,6 +74,7 @@ typedef struct Scene {
 	Colour background;
 	CubeMap *environment_map;
 	Surface *root;
+	Bvh *bvh; /* Over all surfaces in root */
 } Scene;
 
 typedef struct Sdl {
@@ -89,6 +91,9 @@ typedef struct Sdl {
 	Material *material;
 
 	Scene internal_scene;
+
+	/* The surfaces, and the matrix stack while importing them */
+	Arena arena;
 } Sdl;
 
 typedef struct Config {
@@ -100,6 +105,7 @@ typedef struct Config {
 	int reflection_samples;
 	int max_reflections;
 	bool depth_of_field;
+	KdParams kd;
 } Config;
 
 const Config *config;
@@ -1,56 +1,99 @@
+#include <float.h>
 #include <math.h>
+#include <stdlib.h>
 
 #include "shading.h"
 #include "ray.h"
 #include "colour.h"
 
-static Colour hit_light_colour(Hit *hit, Light *light, Vec3 cam_dir)
+/* How far secondary rays start off the surface at p. In single precision
+ * the rounding error in p grows with its distance from the origin, so the
+ * offset has to grow along with it. */
+static Real ray_offset(Vec3 p, Real offset)
+{
+#ifdef CG_SINGLE_PRECISION
+	Real extent = MAX(fabsf(p.x), MAX(fabsf(p.y), fabsf(p.z)));
+
+	return MAX(offset, 32*FLT_EPSILON*extent);
+#else
+	(void) p;
+	return offset;
+#endif
+}
+
+/* The ray from just off the hit to a point on a light */
+static Ray shadow_ray_to(const Hit *hit, Vec3 light_pos)
+{
+	Ray shadow_ray;
+
+	shadow_ray.direction = vec3_normalize(vec3_sub(light_pos, hit->position));
+	shadow_ray.origin = vec3_add(hit->position, vec3_scale(
+			ray_offset(hit->position, 1e-4), shadow_ray.direction));
+	shadow_ray.near = 0;
+	shadow_ray.far = vec3_length(vec3_sub(light_pos, hit->position));
+
+	return shadow_ray;
+}
+
+/* What an unoccluded shadow ray brings back from the light */
+static Colour light_sample_colour(const Hit *hit, Light *light, Vec3 cam_dir,
+		Ray shadow_ray)
 {
 	Material *mat = hit->surface->material;
-	Vec3 normal = hit->normal;
-	Vec3 light_dir;
-	Vec3 light_pos;
+	Colour diff_col, spec_col;
+
+	diff_col = diff_colour(light, mat, cam_dir, shadow_ray.direction,
+			hit->normal);
+	spec_col = spec_colour(light, mat, cam_dir, shadow_ray.direction,
+			hit->normal);
+
+	return colour_add(diff_col, spec_col);
+}
+
+/* A point light is an area light with only one sample */
+static int light_samples(const Light *light)
+{
+	return light->type == LIGHT_AREA ? config->shadow_samples : 1;
+}
+
+/* Sample j out of the n by n stratified samples of the light */
+static Vec3 light_sample_position(const Light *light, int j, int n, Rng *rng)
+{
+	int p, q;
+	float alpha, beta;
+
+	if (light->type != LIGHT_AREA)
+		return light->position;
+
+	p = j % n;
+	q = j / n;
+	alpha = p / (float) n + rng_double(rng);
+	beta =  q / (float) n + rng_double(rng);
+
+	return vec3_add(vec3_add(light->position,
+			vec3_scale(alpha, light->plane.edge1)),
+			vec3_scale(beta, light->plane.edge2));
+}
+
+static Colour hit_light_colour(Hit *hit, Light *light, Vec3 cam_dir,
+		Rng *rng)
+{
 	Colour light_total;
 	int n;
 
 	light_total = BLACK;
-	/* A point light is an area light with only one samples */
-	n = light->type == LIGHT_AREA ? config->shadow_samples : 1;
+	n = light_samples(light);
 	for (int j = 0; j < SQUARE(n); j++)
 	{
 		Ray shadow_ray;
-		Hit dummy;
-		Colour diff_col, spec_col;
-
-		if (light->type == LIGHT_AREA)
-		{
-			int p, q;
-			float alpha, beta;
-			p = j % n;
-			q = j / n;
-			alpha = p / (float) n + drand();
-			beta =  q / (float) n + drand();
-
-			light_pos = vec3_add(vec3_add(light->position,
-					vec3_scale(alpha, light->plane.edge1)),
-					vec3_scale(beta, light->plane.edge2));
-		}
-		else
-			light_pos = light->position;
-
-		light_dir = vec3_normalize(vec3_sub(light_pos, hit->position));
 
-		shadow_ray.direction = light_dir;
-		shadow_ray.origin = vec3_add(hit->position,
-				vec3_scale(1e-4, shadow_ray.direction));
-		shadow_ray.near = 0;
-		shadow_ray.far = vec3_length(vec3_sub(light_pos, hit->position));
-		if (ray_intersect(shadow_ray, &dummy))
+		shadow_ray = shadow_ray_to(hit,
+				light_sample_position(light, j, n, rng));
+		if (ray_occluded(shadow_ray))
 			continue;
 
-		diff_col = diff_colour(light, mat, cam_dir, light_dir, normal);
-		spec_col = spec_colour(light, mat, cam_dir, light_dir, normal);
-		light_total = colour_add(light_total, colour_add(diff_col, spec_col));
+		light_total = colour_add(light_total,
+				light_sample_colour(hit, light, cam_dir, shadow_ray));
 	}
 	light_total = colour_scale(1.0/SQUARE(n), light_total);
 
@@ -67,51 +110,89 @@ static Vec3 vec3_orthogonal_vec3(Vec3 v)
 		return vec3_cross(v, n2);
 }
 
-static Colour hit_reflection_colour(Hit *hit, Ray ray, int depth)
+/* Only gloss primary and the first reflected rays.
+ * This is a crude form of importance sampling */
+static bool glossy_reflection(const Material *mat, int depth)
+{
+	return mat->glossiness > 0.0 && depth <= 1;
+}
+
+/* How many rays the reflection at the hit is sampled with */
+static int reflection_rays(const Hit *hit, int depth)
 {
-	Colour total;
 	Material *mat = hit->surface->material;
-	Ray rray;
 
 	/* Non-reflecting material */
 	if (mat->reflect <= 0.0)
-		return BLACK;
+		return 0;
+
+	return glossy_reflection(mat, depth) ? config->reflection_samples : 1;
+}
+
+/* Reflection ray number i, and the random stream that goes along with it */
+static Ray reflection_ray(const Hit *hit, Ray ray, int depth, int i,
+		const Rng *rng, Rng *prng)
+{
+	Material *mat = hit->surface->material;
+	Ray rray;
+	Vec3 a, b;
 
 	/* First, create the unperturbed reflection ray */
 	rray.direction = vec3_reflect(ray.direction, hit->normal);
-	rray.origin = vec3_add(hit->position, vec3_scale(1e-2, rray.direction));
+	rray.origin = vec3_add(hit->position, vec3_scale(
+			ray_offset(hit->position, 1e-2), rray.direction));
 	rray.near = 0;
 	rray.far = HUGE_VAL;
 
-	/* Only gloss primary and the first reflected rays.
-	 * This is a crude form of importance sampling */
-	if (mat->glossiness <= 0.0 || depth > 1)
-		total = ray_colour(rray, depth + 1);
-	else
+	*prng = rng_branch(rng, depth + 1, i);
+	if (!glossy_reflection(mat, depth))
+		return rray;
+
+	/* The ray direction needs to be normalized for this to work */
+	rray.direction = vec3_normalize(rray.direction);
+	/* Create an orthonormal basis for the tangent vector space */
+	a = vec3_normalize(vec3_orthogonal_vec3(rray.direction));
+	b = vec3_normalize(vec3_cross(rray.direction, a));
+
+	a = vec3_scale(mat->glossiness * (2*rng_double(prng) - 1), a);
+	b = vec3_scale(mat->glossiness * (2*rng_double(prng) - 1), b);
+	rray.direction = vec3_add(rray.direction, vec3_add(a, b));
+
+	return rray;
+}
+
+static Colour hit_reflection_colour(Hit *hit, Ray ray, int depth, Rng *rng)
+{
+	Material *mat = hit->surface->material;
+	Colour total;
+	int n;
+
+	n = reflection_rays(hit, depth);
+	if (n == 0)
+		return BLACK;
+
+	total = BLACK;
+	for (int i = 0; i < n; i++)
 	{
-		total = BLACK;
-		for (int i = 0; i < config->reflection_samples; i++)
-		{
-			Ray pray = rray; /* Perturbed ray */
-			Vec3 a, b;
-
-			/* The ray direction needs to be normalized for this to work */
-			pray.direction = vec3_normalize(pray.direction);
-			/* Create an orthonormal basis for the tangent vector space */
-			a = vec3_normalize(vec3_orthogonal_vec3(pray.direction));
-			b = vec3_normalize(vec3_cross(pray.direction, a));
-
-			a = vec3_scale(mat->glossiness * (2*drand() - 1), a);
-			b = vec3_scale(mat->glossiness * (2*drand() - 1), b);
-			pray.direction = vec3_add(pray.direction, vec3_add(a, b));
-			total = colour_add(total, ray_colour(pray, depth + 1));
-		}
-		total = colour_scale(1./config->reflection_samples, total);
+		Rng prng;
+		Ray rray = reflection_ray(hit, ray, depth, i, rng, &prng);
+
+		total = colour_add(total, ray_colour(rray, depth + 1, &prng));
 	}
+	total = colour_scale(1./n, total);
+
 	return colour_mul(mat->specular_colour, colour_scale(mat->reflect, total));
 }
 
-Colour ray_colour(Ray ray, int depth)
+static Colour miss_colour(Ray ray)
+{
+	if (scene->environment_map)
+		return cubemap_colour(scene->environment_map, ray.direction);
+	else
+		return scene->background;
+}
+
+Colour ray_colour(Ray ray, int depth, Rng *rng)
 {
 	Hit hit;
 	Colour total;
@@ -121,21 +202,459 @@ Colour ray_colour(Ray ray, int depth)
 		return BLACK;
 
 	if (!ray_intersect(ray, &hit))
-	{
-		if (scene->environment_map)
-			return cubemap_colour(scene->environment_map, ray.direction);
-		else
-			return scene->background;
-	}
+		return miss_colour(ray);
 
 	total = BLACK;
 	/* Direct contributions from light */
 	for (int i = 0; i < scene->num_lights; i++)
 		total = colour_add(total,
-				hit_light_colour(&hit, scene->light[i], cam_dir));
+				hit_light_colour(&hit, scene->light[i], cam_dir, rng));
 
 	/* Indirect contributions from reflections */
-	total = colour_add(total, hit_reflection_colour(&hit, ray, depth));
+	total = colour_add(total, hit_reflection_colour(&hit, ray, depth, rng));
 
 	return total;
 }
+
+/* ray_colour() for a packet of primary rays. The shadow rays of all the hits
+ * to a point light go out as a packet as well. Everything after that is done
+ * one ray at a time. */
+void ray_packet_colour(const Ray *ray, int n, Colour *colour, Rng *rng)
+{
+	Hit hit[RAY_PACKET_MAX];
+	Ray shadow_ray[RAY_PACKET_MAX];
+	bool occluded[RAY_PACKET_MAX];
+	int lit[RAY_PACKET_MAX];
+	Vec3 cam_dir[RAY_PACKET_MAX];
+
+	if (0 > config->max_reflections)
+	{
+		for (int i = 0; i < n; i++)
+			colour[i] = BLACK;
+		return;
+	}
+
+	ray_packet_intersect(ray, n, hit);
+	for (int i = 0; i < n; i++)
+	{
+		cam_dir[i] = vec3_normalize(vec3_scale(-1, ray[i].direction));
+		colour[i] = hit[i].surface == NULL ? miss_colour(ray[i]) : BLACK;
+	}
+
+	for (int l = 0; l < scene->num_lights; l++)
+	{
+		Light *light = scene->light[l];
+		int m = 0;
+
+		if (light->type == LIGHT_AREA)
+		{
+			for (int i = 0; i < n; i++)
+				if (hit[i].surface != NULL)
+					colour[i] = colour_add(colour[i], hit_light_colour(&hit[i],
+							light, cam_dir[i], &rng[i]));
+			continue;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			if (hit[i].surface == NULL)
+				continue;
+
+			lit[m] = i;
+			shadow_ray[m++] = shadow_ray_to(&hit[i], light->position);
+		}
+		ray_packet_occluded(shadow_ray, m, occluded);
+		for (int k = 0; k < m; k++)
+		{
+			const int i = lit[k];
+			Colour light_total = BLACK;
+
+			if (!occluded[k])
+				light_total = colour_add(light_total, light_sample_colour(
+						&hit[i], light, cam_dir[i], shadow_ray[k]));
+			colour[i] = colour_add(colour[i], light_total);
+		}
+	}
+
+	for (int i = 0; i < n; i++)
+		if (hit[i].surface != NULL)
+			colour[i] = colour_add(colour[i],
+					hit_reflection_colour(&hit[i], ray[i], 0, &rng[i]));
+}
+
+/************************
+ * Wavefront integrator *
+ ************************/
+
+/* Instead of following every ray depth first, the wavefront integrator
+ * intersects all rays of one generation together. Their hits queue up
+ * shadow rays and the next generation of reflection rays. Each queue is
+ * sorted so rays that start close together and go the same way get traced
+ * one after the other, as packets.
+ *
+ * Every ray gets a node in a tree that mirrors the calls ray_colour() would
+ * make. The results of its shadow rays and reflection rays are stored there
+ * rather than added up straight away, and once a batch is done the tree is
+ * summed bottom up, in the same order ray_colour() would sum it. */
+
+typedef struct PathRay {
+	Ray ray;
+	Rng rng;
+	int node; /* Where its colour goes */
+	int depth; /* Camera rays start out at depth 0 */
+	uint32_t key; /* For sorting */
+} PathRay;
+
+typedef struct ShadowRay {
+	Ray ray;
+	int sample; /* Of the light that it was sent to */
+	uint32_t key;
+} ShadowRay;
+
+/* A sample of a light at a hit, and whether it made it there */
+typedef struct LightSample {
+	Colour colour;
+	bool lit;
+} LightSample;
+
+/* A ray and what it adds up to. The samples of all lights come one after
+ * the other, and so do the nodes of its reflection rays. */
+typedef struct PathNode {
+	Colour colour; /* What ray_colour() returns for the ray */
+	const Material *material; /* Of the hit, or NULL if the ray missed */
+	int first_sample;
+	int first_child, num_children;
+} PathNode;
+
+typedef struct PathQueue {
+	int num_rays, max_rays;
+	PathRay *ray;
+} PathQueue;
+
+typedef struct ShadowQueue {
+	int num_rays, max_rays;
+	ShadowRay *ray;
+} ShadowQueue;
+
+typedef struct PathTree {
+	int num_nodes, max_nodes;
+	PathNode *node;
+	int num_samples, max_samples;
+	LightSample *sample;
+} PathTree;
+
+/* Camera rays are traced this many at a time, which puts a bound on how many
+ * reflection rays they can spawn. Shadow rays are flushed whenever about as
+ * many have piled up. */
+enum { WAVEFRONT_BATCH = 1024, SHADOW_FLUSH = 4096 };
+
+static PathRay *path_queue_push(PathQueue *queue)
+{
+	if (queue->num_rays == queue->max_rays)
+	{
+		queue->max_rays = MAX(2*queue->max_rays, WAVEFRONT_BATCH);
+		queue->ray = realloc(queue->ray, queue->max_rays*sizeof(PathRay));
+	}
+
+	return &queue->ray[queue->num_rays++];
+}
+
+static ShadowRay *shadow_queue_push(ShadowQueue *queue)
+{
+	if (queue->num_rays == queue->max_rays)
+	{
+		queue->max_rays = MAX(2*queue->max_rays, SHADOW_FLUSH);
+		queue->ray = realloc(queue->ray, queue->max_rays*sizeof(ShadowRay));
+	}
+
+	return &queue->ray[queue->num_rays++];
+}
+
+/* Returns the index of the new node, since the nodes may move */
+static int path_tree_push(PathTree *tree)
+{
+	if (tree->num_nodes == tree->max_nodes)
+	{
+		tree->max_nodes = MAX(2*tree->max_nodes, WAVEFRONT_BATCH);
+		tree->node = realloc(tree->node, tree->max_nodes*sizeof(PathNode));
+	}
+	tree->node[tree->num_nodes].material = NULL;
+	tree->node[tree->num_nodes].num_children = 0;
+
+	return tree->num_nodes++;
+}
+
+static LightSample *path_tree_sample(PathTree *tree)
+{
+	if (tree->num_samples == tree->max_samples)
+	{
+		tree->max_samples = MAX(2*tree->max_samples, SHADOW_FLUSH);
+		tree->sample = realloc(tree->sample,
+				tree->max_samples*sizeof(LightSample));
+	}
+
+	return &tree->sample[tree->num_samples++];
+}
+
+/* Spread the bits of a 9 bit number out over 27 */
+static uint32_t morton_spread(uint32_t x)
+{
+	uint32_t r = 0;
+
+	for (int i = 0; i < 9; i++)
+		r |= (x >> i & 1) << 3*i;
+
+	return r;
+}
+
+/* The direction octant of the ray, and where it starts along a Morton curve
+ * through the scene's bounding box */
+static uint32_t ray_sort_key(Ray ray)
+{
+	const BBox *bbox = &scene->bvh->node[0].bbox;
+	const float o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+	const float lo[3] = {bbox->xmin, bbox->ymin, bbox->zmin};
+	const float hi[3] = {bbox->xmax, bbox->ymax, bbox->zmax};
+	uint32_t key;
+
+	key = (ray.direction.x < 0) << 2 | (ray.direction.y < 0) << 1 |
+			(ray.direction.z < 0);
+	key <<= 27;
+	for (int k = 0; k < 3; k++)
+	{
+		float f = hi[k] > lo[k] ? (o[k] - lo[k])/(hi[k] - lo[k]) : 0;
+		uint32_t cell = CLAMP(f, 0, 1)*511;
+
+		key |= morton_spread(cell) << k;
+	}
+
+	return key;
+}
+
+static int path_ray_compare(const void *a, const void *b)
+{
+	const PathRay *ra = a, *rb = b;
+
+	return (ra->key > rb->key) - (ra->key < rb->key);
+}
+
+static int shadow_ray_compare(const void *a, const void *b)
+{
+	const ShadowRay *ra = a, *rb = b;
+
+	return (ra->key > rb->key) - (ra->key < rb->key);
+}
+
+static void trace_shadow_queue(ShadowQueue *queue, PathTree *tree)
+{
+	if (scene->bvh->num_nodes > 0)
+	{
+		for (int i = 0; i < queue->num_rays; i++)
+			queue->ray[i].key = ray_sort_key(queue->ray[i].ray);
+		qsort(queue->ray, queue->num_rays, sizeof(ShadowRay),
+				shadow_ray_compare);
+	}
+
+	for (int i = 0; i < queue->num_rays; i += RAY_PACKET_MAX)
+	{
+		const int n = MIN(RAY_PACKET_MAX, queue->num_rays - i);
+		ShadowRay *shadow = &queue->ray[i];
+		Ray ray[RAY_PACKET_MAX];
+		bool occluded[RAY_PACKET_MAX];
+
+		for (int k = 0; k < n; k++)
+			ray[k] = shadow[k].ray;
+		ray_packet_occluded(ray, n, occluded);
+		for (int k = 0; k < n; k++)
+			tree->sample[shadow[k].sample].lit = !occluded[k];
+	}
+	queue->num_rays = 0;
+}
+
+/* Everything ray_colour() does at a hit, except that the shadow and
+ * reflection rays are queued up instead of traced */
+static void shade_path_hit(PathRay *path, Hit *hit, ShadowQueue *shadows,
+		PathQueue *next, PathTree *tree)
+{
+	PathNode *node = &tree->node[path->node];
+	Vec3 cam_dir = vec3_normalize(vec3_scale(-1, path->ray.direction));
+	int n;
+
+	node->material = hit->surface->material;
+	node->first_sample = tree->num_samples;
+
+	/* Direct contributions from light */
+	for (int i = 0; i < scene->num_lights; i++)
+	{
+		Light *light = scene->light[i];
+
+		n = light_samples(light);
+		for (int j = 0; j < SQUARE(n); j++)
+		{
+			ShadowRay *shadow = shadow_queue_push(shadows);
+			LightSample *sample;
+
+			shadow->ray = shadow_ray_to(hit,
+					light_sample_position(light, j, n, &path->rng));
+			shadow->sample = tree->num_samples;
+			sample = path_tree_sample(tree);
+			sample->colour = light_sample_colour(hit, light, cam_dir,
+					shadow->ray);
+			sample->lit = false;
+		}
+	}
+
+	/* Indirect contributions from reflections */
+	n = reflection_rays(hit, path->depth);
+	if (n == 0 || path->depth + 1 > config->max_reflections)
+		return;
+	node->first_child = tree->num_nodes;
+	node->num_children = n;
+	for (int i = 0; i < n; i++)
+	{
+		PathRay *child = path_queue_push(next);
+
+		child->ray = reflection_ray(hit, path->ray, path->depth, i, &path->rng,
+				&child->rng);
+		child->node = path_tree_push(tree);
+		child->depth = path->depth + 1;
+	}
+}
+
+/* Finds what every node of the tree adds up to. The nodes of reflection rays
+ * always come after the node of the ray they were reflected from. */
+static void path_tree_colours(PathTree *tree)
+{
+	for (int i = tree->num_nodes - 1; i >= 0; i--)
+	{
+		PathNode *node = &tree->node[i];
+		const LightSample *sample = &tree->sample[node->first_sample];
+		Colour total;
+
+		if (node->material == NULL)
+			continue;
+
+		/* Direct contributions from light, as in hit_light_colour() */
+		total = BLACK;
+		for (int l = 0; l < scene->num_lights; l++)
+		{
+			const int n = light_samples(scene->light[l]);
+			Colour light_total = BLACK;
+
+			for (int j = 0; j < SQUARE(n); j++, sample++)
+				if (sample->lit)
+					light_total = colour_add(light_total, sample->colour);
+			light_total = colour_scale(1.0/SQUARE(n), light_total);
+			total = colour_add(total, light_total);
+		}
+
+		/* Indirect contributions, as in hit_reflection_colour() */
+		if (node->num_children > 0)
+		{
+			const PathNode *child = &tree->node[node->first_child];
+			Colour reflected = BLACK;
+
+			for (int k = 0; k < node->num_children; k++)
+				reflected = colour_add(reflected, child[k].colour);
+			reflected = colour_scale(1./node->num_children, reflected);
+			total = colour_add(total, colour_mul(
+					node->material->specular_colour,
+					colour_scale(node->material->reflect, reflected)));
+		}
+
+		node->colour = total;
+	}
+}
+
+/* Sets the node of every ray in the queue to its colour */
+static void trace_wavefront_batch(PathQueue *queue, PathQueue *next,
+		ShadowQueue *shadows, PathTree *tree)
+{
+	while (queue->num_rays > 0)
+	{
+		PathQueue swap;
+
+		if (scene->bvh->num_nodes > 0)
+		{
+			for (int i = 0; i < queue->num_rays; i++)
+				queue->ray[i].key = ray_sort_key(queue->ray[i].ray);
+			qsort(queue->ray, queue->num_rays, sizeof(PathRay),
+					path_ray_compare);
+		}
+
+		next->num_rays = 0;
+		for (int i = 0; i < queue->num_rays; i += RAY_PACKET_MAX)
+		{
+			const int n = MIN(RAY_PACKET_MAX, queue->num_rays - i);
+			PathRay *path = &queue->ray[i];
+			Ray ray[RAY_PACKET_MAX];
+			Hit hit[RAY_PACKET_MAX];
+
+			for (int k = 0; k < n; k++)
+				ray[k] = path[k].ray;
+			ray_packet_intersect(ray, n, hit);
+
+			for (int k = 0; k < n; k++)
+			{
+				if (hit[k].surface == NULL)
+					tree->node[path[k].node].colour = miss_colour(ray[k]);
+				else
+					shade_path_hit(&path[k], &hit[k], shadows, next, tree);
+			}
+			if (shadows->num_rays >= SHADOW_FLUSH)
+				trace_shadow_queue(shadows, tree);
+		}
+		trace_shadow_queue(shadows, tree);
+
+		swap = *queue;
+		*queue = *next;
+		*next = swap;
+	}
+
+	path_tree_colours(tree);
+}
+
+/* The wavefront counterpart of ray_packet_colour(), for any number of rays */
+void ray_colour_wavefront(const Ray *ray, int n, Colour *colour,
+		const Rng *rng)
+{
+	PathQueue queue = {0, 0, NULL}, next = {0, 0, NULL};
+	ShadowQueue shadows = {0, 0, NULL};
+	PathTree tree = {0, 0, NULL, 0, 0, NULL};
+
+	if (0 > config->max_reflections)
+	{
+		for (int i = 0; i < n; i++)
+			colour[i] = BLACK;
+		return;
+	}
+
+	for (int i = 0; i < n; i += WAVEFRONT_BATCH)
+	{
+		const int m = MIN(WAVEFRONT_BATCH, n - i);
+
+		queue.num_rays = 0;
+		tree.num_nodes = 0;
+		tree.num_samples = 0;
+		for (int k = 0; k < m; k++)
+		{
+			PathRay *path = path_queue_push(&queue);
+
+			path->ray = ray[i + k];
+			path->rng = rng[i + k];
+			path->node = path_tree_push(&tree);
+			path->depth = 0;
+		}
+
+		trace_wavefront_batch(&queue, &next, &shadows, &tree);
+		/* The camera rays got the first nodes */
+		for (int k = 0; k < m; k++)
+			colour[i + k] = tree.node[k].colour;
+	}
+
+	free(queue.ray);
+	free(next.ray);
+	free(shadows.ray);
+	free(tree.node);
+	free(tree.sample);
+}
@@ -4,6 +4,9 @@
 #include "ray.h"
 #include "colour.h"
 
-Colour ray_colour(Ray ray, int ttl);
+Colour ray_colour(Ray ray, int ttl, Rng *rng);
+void ray_packet_colour(const Ray *ray, int n, Colour *colour, Rng *rng);
+void ray_colour_wavefront(const Ray *ray, int n, Colour *colour,
+		const Rng *rng);
 
 #endif
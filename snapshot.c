@@ -0,0 +1,464 @@
+#define _POSIX_C_SOURCE 200112L
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+/* The file is an image of the scene's memory. Every structure and array sits
+ * at an offset that is a multiple of SNAPSHOT_ALIGN, and every pointer holds
+ * the offset of what it points to, or 0 for NULL. The relocation table lists
+ * where the pointers are, so loading only has to add the address the file
+ * was mapped at to those. The bulk of the data, the meshes and textures, is
+ * never written to and stays shared with the page cache. */
+#define SNAPSHOT_MAGIC "CGSCENE\n"
+enum { SNAPSHOT_VERSION = 2, SNAPSHOT_ALIGN = 64 };
+
+typedef struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order; /* 0x01020304 as written */
+	uint32_t pointer_size;
+	uint32_t real_size;
+	uint32_t kd_simd_width;
+	/* The sizes of the main structures, so a file from a build where any
+	 * of their layouts differ is refused, version or not */
+	uint32_t sdl_size;
+	uint32_t config_size;
+	uint32_t shape_size;
+	uint32_t mesh_size;
+	uint32_t surface_size;
+	uint32_t record_size;
+	uint32_t num_relocations;
+	uint64_t sdl;
+	uint64_t config;
+	uint64_t relocation;
+} SnapshotHeader;
+
+/* The file as it is being put together in memory */
+typedef struct Snapshot {
+	char *image;
+	size_t size;
+	size_t capacity;
+	uint64_t *relocation;
+	int num_relocations;
+	int max_relocations;
+} Snapshot;
+
+/* Zeroed room for size bytes, at the returned offset */
+static uint64_t snap_alloc(Snapshot *snap, size_t size)
+{
+	uint64_t offset = (snap->size + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN *
+			SNAPSHOT_ALIGN;
+
+	if (offset + size > snap->capacity)
+	{
+		snap->capacity = MAX(2 * snap->capacity, offset + size);
+		snap->image = realloc(snap->image, snap->capacity);
+	}
+	memset(snap->image + snap->size, 0, offset + size - snap->size);
+	snap->size = offset + size;
+
+	return offset;
+}
+
+static uint64_t snap_copy(Snapshot *snap, const void *data, size_t size)
+{
+	uint64_t offset;
+
+	if (data == NULL || size == 0)
+		return 0;
+
+	offset = snap_alloc(snap, size);
+	memcpy(snap->image + offset, data, size);
+
+	return offset;
+}
+
+static uint64_t snap_string(Snapshot *snap, const char *string)
+{
+	return string ? snap_copy(snap, string, strlen(string) + 1) : 0;
+}
+
+/* Makes the pointer at offset field point at offset target once loaded */
+static void snap_pointer(Snapshot *snap, uint64_t field, uint64_t target)
+{
+	memcpy(snap->image + field, &target, sizeof(target));
+	if (target == 0)
+		return;
+
+	if (snap->num_relocations == snap->max_relocations)
+	{
+		snap->max_relocations = MAX(2 * snap->max_relocations, 1024);
+		snap->relocation = realloc(snap->relocation,
+				snap->max_relocations * sizeof(uint64_t));
+	}
+	snap->relocation[snap->num_relocations++] = field;
+}
+
+#define SNAP_FIELD(offset, type, field) ((offset) + offsetof(type, field))
+
+static uint64_t snap_texture(Snapshot *snap, const Texture *texture)
+{
+	uint64_t offset = snap_copy(snap, texture, sizeof(Texture));
+
+	snap_pointer(snap, SNAP_FIELD(offset, Texture, buffer),
+			snap_copy(snap, texture->buffer,
+			texture->width * texture->height * sizeof(Colour)));
+
+	return offset;
+}
+
+static uint64_t snap_mesh(Snapshot *snap, const Mesh *mesh)
+{
+	uint64_t offset = snap_copy(snap, mesh, sizeof(Mesh));
+	Mesh *copy = (Mesh *) (snap->image + offset);
+
+	copy->file = NULL;
+	copy->file_size = 0;
+	memset(&copy->kd_arena, 0, sizeof(Arena));
+	copy->kd_lazy = NULL;
+
+#define SNAP_ARRAY(field, count) \
+	snap_pointer(snap, SNAP_FIELD(offset, Mesh, field), snap_copy(snap, \
+			mesh->field, (size_t) (count) * sizeof(mesh->field[0])))
+
+	snap_pointer(snap, SNAP_FIELD(offset, Mesh, name),
+			snap_string(snap, mesh->name));
+	SNAP_ARRAY(vertex, mesh->num_vertices);
+	SNAP_ARRAY(normal, mesh->has_normals ? mesh->num_normals : 0);
+	SNAP_ARRAY(texcoord, mesh->has_texcoords ? mesh->num_texcoords : 0);
+	SNAP_ARRAY(triangle, mesh->triangle ? mesh->num_triangles : 0);
+	SNAP_ARRAY(index16, mesh->index16 ? 3 * mesh->num_triangles : 0);
+	SNAP_ARRAY(index32, mesh->index32 ? 3 * mesh->num_triangles : 0);
+	SNAP_ARRAY(kd_node, mesh->num_kd_nodes);
+	SNAP_ARRAY(kd_index, mesh->num_kd_indices);
+	SNAP_ARRAY(kd_block, mesh->num_kd_indices / KD_SIMD_WIDTH);
+	SNAP_ARRAY(bvh_node, mesh->num_bvh_nodes);
+	SNAP_ARRAY(bvh_index, mesh->num_bvh_indices);
+	SNAP_ARRAY(bvh_block, mesh->num_bvh_indices / KD_SIMD_WIDTH);
+#undef SNAP_ARRAY
+
+	return offset;
+}
+
+/* The BVH refers to the surfaces by pointer, so these are sorted to find
+ * their place in the file */
+typedef struct SurfaceOffset {
+	const Surface *surface;
+	uint64_t offset;
+} SurfaceOffset;
+
+static int compare_surfaces(const void *a, const void *b)
+{
+	uintptr_t sa = (uintptr_t) ((const SurfaceOffset *) a)->surface;
+	uintptr_t sb = (uintptr_t) ((const SurfaceOffset *) b)->surface;
+
+	return sa < sb ? -1 : sa > sb;
+}
+
+static uint64_t surface_offset(const SurfaceOffset *sorted, int n,
+		const Surface *surface)
+{
+	SurfaceOffset key = {surface, 0};
+	const SurfaceOffset *found;
+
+	found = bsearch(&key, sorted, n, sizeof(key), compare_surfaces);
+	assert(found != NULL);
+
+	return found->offset;
+}
+
+static void snap_scene(Snapshot *snap, const Sdl *sdl, uint64_t sdl_offset,
+		uint64_t cameras, uint64_t lights, uint64_t shapes,
+		uint64_t materials, const uint64_t *meshes)
+{
+	const Scene *sc = &sdl->internal_scene;
+	const uint64_t offset = SNAP_FIELD(sdl_offset, Sdl, internal_scene);
+	const Bvh *bvh = sc->bvh;
+	SurfaceOffset *sorted;
+	uint64_t surfaces = 0, bvh_offset, record;
+	int num_surfaces = 0, i;
+
+	snap_pointer(snap, SNAP_FIELD(offset, Scene, camera),
+			cameras + (sc->camera - sdl->camera) * sizeof(Camera));
+	for (i = 0; i < MAX_LIGHTS; i++)
+		snap_pointer(snap, SNAP_FIELD(offset, Scene, light) +
+				i * sizeof(Light *), i < sc->num_lights ?
+				lights + (sc->light[i] - sdl->light) * sizeof(Light) : 0);
+
+	if (sc->environment_map)
+	{
+		uint64_t map = snap_copy(snap, sc->environment_map, sizeof(CubeMap));
+
+		for (i = 0; i < 6; i++)
+			snap_pointer(snap, SNAP_FIELD(map, CubeMap, texture) +
+					i * sizeof(Texture *),
+					snap_texture(snap, sc->environment_map->texture[i]));
+		snap_pointer(snap, SNAP_FIELD(offset, Scene, environment_map), map);
+	}
+
+	/* The surfaces become an array, in the order of the list */
+	for (const Surface *surf = sc->root; surf; surf = surf->next)
+		num_surfaces++;
+	sorted = calloc(MAX(num_surfaces, 1), sizeof(SurfaceOffset));
+	if (num_surfaces > 0)
+		surfaces = snap_alloc(snap, num_surfaces * sizeof(Surface));
+	i = 0;
+	for (const Surface *surf = sc->root; surf; surf = surf->next, i++)
+	{
+		const uint64_t s = surfaces + i * sizeof(Surface);
+
+		memcpy(snap->image + s, surf, sizeof(Surface));
+		snap_pointer(snap, SNAP_FIELD(s, Surface, shape),
+				shapes + (surf->shape - sdl->shape) * sizeof(Shape));
+		snap_pointer(snap, SNAP_FIELD(s, Surface, material),
+				materials + (surf->material - sdl->material) *
+				sizeof(Material));
+		snap_pointer(snap, SNAP_FIELD(s, Surface, next),
+				surf->next ? s + sizeof(Surface) : 0);
+		sorted[i].surface = surf;
+		sorted[i].offset = s;
+	}
+	snap_pointer(snap, SNAP_FIELD(offset, Scene, root), surfaces);
+	qsort(sorted, num_surfaces, sizeof(SurfaceOffset), compare_surfaces);
+
+	bvh_offset = snap_copy(snap, bvh, sizeof(Bvh));
+	snap_pointer(snap, SNAP_FIELD(offset, Scene, bvh), bvh_offset);
+	snap_pointer(snap, SNAP_FIELD(bvh_offset, Bvh, node),
+			snap_copy(snap, bvh->node, bvh->num_nodes * sizeof(BvhNode)));
+	if (bvh->num_surfaces > 0)
+	{
+		uint64_t array = snap_alloc(snap,
+				bvh->num_surfaces * sizeof(Surface *));
+
+		for (i = 0; i < bvh->num_surfaces; i++)
+			snap_pointer(snap, array + i * sizeof(Surface *),
+					surface_offset(sorted, num_surfaces, bvh->surface[i]));
+		snap_pointer(snap, SNAP_FIELD(bvh_offset, Bvh, surface), array);
+
+		record = snap_copy(snap, bvh->record,
+				bvh->num_surfaces * sizeof(SurfaceRecord));
+		for (i = 0; i < bvh->num_surfaces; i++)
+		{
+			const SurfaceRecord *rec = &bvh->record[i];
+			const uint64_t r = record + i * sizeof(SurfaceRecord);
+
+			snap_pointer(snap, SNAP_FIELD(r, SurfaceRecord, surface),
+					surface_offset(sorted, num_surfaces, rec->surface));
+			if (rec->type == SHAPE_MESH)
+				snap_pointer(snap, SNAP_FIELD(r, SurfaceRecord, u.mesh),
+						meshes[rec->surface->shape - sdl->shape]);
+		}
+		snap_pointer(snap, SNAP_FIELD(bvh_offset, Bvh, record), record);
+	} else
+	{
+		snap_pointer(snap, SNAP_FIELD(bvh_offset, Bvh, surface), 0);
+		snap_pointer(snap, SNAP_FIELD(bvh_offset, Bvh, record), 0);
+	}
+
+	free(sorted);
+}
+
+bool sdl_compile(const Sdl *sdl, const char *filename)
+{
+	Snapshot snap = {NULL, 0, 0, NULL, 0, 0};
+	SnapshotHeader header;
+	uint64_t sdl_offset, cameras, lights, shapes, materials;
+	uint64_t *meshes;
+	bool ok;
+	FILE *fd;
+
+	snap_alloc(&snap, sizeof(SnapshotHeader));
+	sdl_offset = snap_copy(&snap, sdl, sizeof(Sdl));
+	/* The surfaces are copied out of the arena below */
+	memset(&((Sdl *) (snap.image + sdl_offset))->arena, 0, sizeof(Arena));
+
+	cameras = snap_copy(&snap, sdl->camera, sdl->num_cameras * sizeof(Camera));
+	snap_pointer(&snap, SNAP_FIELD(sdl_offset, Sdl, camera), cameras);
+	for (int i = 0; i < sdl->num_cameras; i++)
+		snap_pointer(&snap, SNAP_FIELD(cameras + i * sizeof(Camera), Camera,
+				name), snap_string(&snap, sdl->camera[i].name));
+
+	lights = snap_copy(&snap, sdl->light, sdl->num_lights * sizeof(Light));
+	snap_pointer(&snap, SNAP_FIELD(sdl_offset, Sdl, light), lights);
+	for (int i = 0; i < sdl->num_lights; i++)
+		snap_pointer(&snap, SNAP_FIELD(lights + i * sizeof(Light), Light,
+				name), snap_string(&snap, sdl->light[i].name));
+
+	materials = snap_copy(&snap, sdl->material,
+			sdl->num_materials * sizeof(Material));
+	snap_pointer(&snap, SNAP_FIELD(sdl_offset, Sdl, material), materials);
+	for (int i = 0; i < sdl->num_materials; i++)
+		snap_pointer(&snap, SNAP_FIELD(materials + i * sizeof(Material),
+				Material, name), snap_string(&snap, sdl->material[i].name));
+
+	/* Textures aren't imported yet, only the cubemap is */
+	((Sdl *) (snap.image + sdl_offset))->num_textures = 0;
+	snap_pointer(&snap, SNAP_FIELD(sdl_offset, Sdl, texture), 0);
+
+	shapes = snap_copy(&snap, sdl->shape, sdl->num_shapes * sizeof(Shape));
+	snap_pointer(&snap, SNAP_FIELD(sdl_offset, Sdl, shape), shapes);
+	meshes = calloc(MAX(sdl->num_shapes, 1), sizeof(uint64_t));
+	for (int i = 0; i < sdl->num_shapes; i++)
+	{
+		const uint64_t s = shapes + i * sizeof(Shape);
+
+		snap_pointer(&snap, SNAP_FIELD(s, Shape, name),
+				snap_string(&snap, sdl->shape[i].name));
+		if (sdl->shape[i].type != SHAPE_MESH)
+			continue;
+		mesh_finish_kd_tree(sdl->shape[i].u.mesh);
+		meshes[i] = snap_mesh(&snap, sdl->shape[i].u.mesh);
+		snap_pointer(&snap, SNAP_FIELD(s, Shape, u.mesh), meshes[i]);
+	}
+
+	snap_scene(&snap, sdl, sdl_offset, cameras, lights, shapes, materials,
+			meshes);
+	free(meshes);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order = 0x01020304;
+	header.pointer_size = sizeof(void *);
+	header.real_size = sizeof(Real);
+	header.kd_simd_width = KD_SIMD_WIDTH;
+	header.sdl_size = sizeof(Sdl);
+	header.config_size = sizeof(Config);
+	header.shape_size = sizeof(Shape);
+	header.mesh_size = sizeof(Mesh);
+	header.surface_size = sizeof(Surface);
+	header.record_size = sizeof(SurfaceRecord);
+	header.sdl = sdl_offset;
+	header.config = snap_copy(&snap, config, sizeof(Config));
+	header.num_relocations = snap.num_relocations;
+	header.relocation = snap_copy(&snap, snap.relocation,
+			snap.num_relocations * sizeof(uint64_t));
+	memcpy(snap.image, &header, sizeof(header));
+
+	if ((fd = fopen(filename, "wb")) == NULL)
+	{
+		printf("Opening file %s failed: %s\n", filename, strerror(errno));
+		ok = false;
+	} else
+	{
+		ok = fwrite(snap.image, 1, snap.size, fd) == snap.size;
+		if (fclose(fd) != 0)
+			ok = false;
+		if (!ok)
+			printf("Writing file %s failed: %s\n", filename, strerror(errno));
+	}
+
+	free(snap.image);
+	free(snap.relocation);
+	return ok;
+}
+
+bool sdl_is_compiled(const char *filename)
+{
+	char magic[8];
+	bool compiled = false;
+	FILE *fd;
+
+	if ((fd = fopen(filename, "rb")) == NULL)
+		return false;
+	if (fread(magic, 1, 8, fd) == 8)
+		compiled = memcmp(magic, SNAPSHOT_MAGIC, 8) == 0;
+	fclose(fd);
+
+	return compiled;
+}
+
+/* The pages are mapped private, so only those that hold pointers get copied
+ * when they are relocated */
+Sdl *sdl_load_compiled(const char *filename)
+{
+	SnapshotHeader header;
+	struct stat st;
+	char *image;
+	size_t size;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+	{
+		printf("Opening file %s failed: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(header))
+	{
+		printf("Reading file %s failed\n", filename);
+		close(fd);
+		return NULL;
+	}
+	size = st.st_size;
+	image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+	{
+		printf("Mapping file %s failed: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+
+	memcpy(&header, image, sizeof(header));
+	if (memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0 ||
+			header.version != SNAPSHOT_VERSION ||
+			header.byte_order != 0x01020304 ||
+			header.pointer_size != sizeof(void *) ||
+			header.real_size != sizeof(Real) ||
+			header.kd_simd_width != KD_SIMD_WIDTH ||
+			header.sdl_size != sizeof(Sdl) ||
+			header.config_size != sizeof(Config) ||
+			header.shape_size != sizeof(Shape) ||
+			header.mesh_size != sizeof(Mesh) ||
+			header.surface_size != sizeof(Surface) ||
+			header.record_size != sizeof(SurfaceRecord))
+	{
+		printf("%s was compiled by a differently configured build, "
+				"compile it again\n", filename);
+		munmap(image, size);
+		return NULL;
+	}
+	if (header.sdl + sizeof(Sdl) > size ||
+			header.config + sizeof(Config) > size ||
+			header.relocation > size ||
+			header.num_relocations > (size - header.relocation) /
+				sizeof(uint64_t))
+	{
+		printf("%s is truncated\n", filename);
+		munmap(image, size);
+		return NULL;
+	}
+
+	for (uint32_t i = 0; i < header.num_relocations; i++)
+	{
+		uint64_t field, target;
+		char *pointer;
+
+		memcpy(&field, image + header.relocation + i * sizeof(uint64_t),
+				sizeof(field));
+		if (field > size - sizeof(target) ||
+				(memcpy(&target, image + field, sizeof(target)),
+				target >= size))
+		{
+			printf("%s is corrupt\n", filename);
+			munmap(image, size);
+			return NULL;
+		}
+		pointer = image + target;
+		memcpy(image + field, &pointer, sizeof(pointer));
+	}
+
+	config = (const Config *) (image + header.config);
+	scene = &((Sdl *) (image + header.sdl))->internal_scene;
+
+	return (Sdl *) (image + header.sdl);
+}
@@ -0,0 +1,14 @@
+#ifndef CG_SNAPSHOT_H
+#define CG_SNAPSHOT_H
+
+#include <stdbool.h>
+#include "scene.h"
+
+/* A compiled scene is a loaded Sdl written out as a single file: cameras,
+ * lights, materials, surfaces, meshes with their trees, the BVH and the
+ * decoded cubemap. Loading it maps the file and relocates its pointers. */
+bool sdl_compile(const Sdl *sdl, const char *filename);
+bool sdl_is_compiled(const char *filename);
+Sdl *sdl_load_compiled(const char *filename);
+
+#endif
@@ -28,17 +28,17 @@ Vec3 vec3_sub(Vec3 a, Vec3 b)
 	return c;
 }
 
-double vec3_dot(Vec3 a, Vec3 b)
+Real vec3_dot(Vec3 a, Vec3 b)
 {
 	return a.x*b.x + a.y*b.y + a.z*b.z;
 }
 
-double vec3_length(Vec3 a)
+Real vec3_length(Vec3 a)
 {
 	return sqrt(vec3_dot(a, a));
 }
 
-Vec3 vec3_scale(double scale, Vec3 a)
+Vec3 vec3_scale(Real scale, Vec3 a)
 {
 	Vec3 b;
 	b.x = a.x * scale;
@@ -63,7 +63,7 @@ Vec3 vec3_cross(Vec3 a, Vec3 b)
 	return c;
 }
 
-Vec3 vec3_lerp(Vec3 a, Vec3 b, double t)
+Vec3 vec3_lerp(Vec3 a, Vec3 b, Real t)
 {
 	Vec3 c;
 	/* c = a*t + b*(1-t) */
@@ -81,7 +81,7 @@ Vec3 vec3_reflect(Vec3 d, Vec3 n)
 }
 
 
-Vec4 vec4_from_vec3(Vec3 v3, double w)
+Vec4 vec4_from_vec3(Vec3 v3, Real w)
 {
 	Vec4 v4;
 	v4.x = v3.x;